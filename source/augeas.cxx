@@ -1,5 +1,15 @@
 #include "augeas.hxx"
 #include <stdexcept>
+#include <sys/inotify.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <glog/logging.h>
 
 using std::vector;
 using std::string;
@@ -7,21 +17,51 @@ using std::runtime_error;
 using std::experimental::optional;
 using std::experimental::make_optional;
 using namespace deter;
+namespace chrono = std::chrono;
 
-Augeas::Augeas()
+static double msSince(chrono::steady_clock::time_point start)
 {
-  aug_ = aug_init(nullptr, nullptr, 0);
+  return chrono::duration<double, std::milli>(
+      chrono::steady_clock::now() - start).count();
+}
+
+/*
+ * Left to itself augeas loads every lens it can find and parses every file
+ * they cover, most of /etc. We only ever look at the interfaces files so
+ * skip all of that and set up the one transform by hand. The tree itself is
+ * not loaded until the first load().
+ */
+Augeas::Augeas(string root)
+{
+  auto start = chrono::steady_clock::now();
+
+  aug_ = aug_init(root.empty() ? nullptr : root.c_str(), nullptr, 
+      AUG_NO_MODL_AUTOLOAD | AUG_NO_LOAD);
   if(aug_ == nullptr)
     throw runtime_error{"augeas init failure"};
+
+  //augeas picks up AUGEAS_ROOT from the environment, ask it where it landed
+  root_ = get("/augeas/root").value_or("/");
+  if(root_.empty() || root_.back() != '/') root_ += "/";
+
+  aug_set(aug_, "/augeas/load/Interfaces/lens", "Interfaces.lns");
+  includes();
+
+  watch();
+
+  LOG(INFO) << "augeas: init at " << root_ << " in " << msSince(start) 
+            << " ms";
 }
 
 Augeas::~Augeas()
 {
+  if(watchFd_ >= 0) close(watchFd_);
   aug_close(aug_);
 }
 
 vector<string> Augeas::match(string path)
 {
+  ++matches_;
   char **matches{nullptr};
   int n = aug_match(aug_, path.c_str(), &matches);
   if(n < 0) return vector<string>{};
@@ -57,12 +97,246 @@ void Augeas::clear(string path, string key)
   aug_rm(aug_, path_key.c_str());
 }
 
-void Augeas::load()
+void Augeas::mv(string src, string dst)
+{
+  if(aug_mv(aug_, src.c_str(), dst.c_str()) < 0)
+    throw runtime_error{"augeas failed to move " + src + " to " + dst};
+}
+
+void Augeas::include(string glob)
 {
+  if(find(extra_.begin(), extra_.end(), glob) != extra_.end()) return;
+  extra_.push_back(glob);
+  stale_ = true;
+  includes();
+}
+
+bool Augeas::load()
+{
+  if(!stale()) return false;
+  reload();
+  return true;
+}
+
+void Augeas::reload()
+{
+  auto start = chrono::steady_clock::now();
+
+  //clear pending events first so a write that lands while we parse is seen
+  //on the next load
+  drain();
+  includes();
   aug_load(aug_);
+  ++loads_;
+  stale_ = false;
+
+  for(const string & e : errors("/augeas/files/etc/network"))
+    LOG(WARNING) << "augeas: " << e;
+
+  LOG(INFO) << "augeas: loaded in " << msSince(start) << " ms";
 }
 
 void Augeas::save()
 {
-  aug_save(aug_);
+  //whatever is queued before our write is someone else's, and a tree that 
+  //was already stale stays so
+  stale();
+
+  int rc = aug_save(aug_);
+  ++saves_;
+
+  //the events generated by our own write are already queued by the time
+  //aug_save returns, throw them away
+  drain();
+
+  //a file that could not be written leaves the tree ahead of the disk, the
+  //caller has to reload
+  if(rc < 0)
+  {
+    string what{"augeas save failed"};
+    for(const string & e : errors("/augeas")) what += "; " + e;
+    throw runtime_error{what};
+  }
+}
+
+vector<string> Augeas::errors(string path)
+{
+  vector<string> result;
+  for(const string & e : match(path + "//error"))
+    result.push_back(
+        e + ": " + get(e + "/message").value_or(get(e).value_or("?")));
+  return result;
+}
+
+bool Augeas::stale()
+{
+  //without a watch we have no idea, so always go to disk
+  if(watchFd_ < 0) return true;
+
+  if(drain()) stale_ = true;
+  return stale_;
+}
+
+Augeas::Stats Augeas::stats() const
+{
+  Stats s;
+  s.matches = matches_;
+  s.loads = loads_;
+  s.saves = saves_;
+  return s;
+}
+
+/*
+ * The source lines are read straight off the disk, the tree they would come
+ * from is what is being set up. Nested sources are not followed, ifupdown2
+ * does not either.
+ */
+void Augeas::includes()
+{
+  vector<string> incl{"/etc/network/interfaces"};
+
+  std::ifstream ifs{root_ + "etc/network/interfaces"};
+  string line;
+  while(std::getline(ifs, line))
+  {
+    std::istringstream ls{line};
+    string keyword, path;
+    ls >> keyword >> path;
+    if(path.empty()) continue;
+
+    if(keyword == "source") incl.push_back(path);
+    else if(keyword == "source-directory") incl.push_back(path + "/*");
+  }
+
+  incl.insert(incl.end(), extra_.begin(), extra_.end());
+
+  aug_rm(aug_, "/augeas/load/Interfaces/incl");
+  wanted_.clear();
+  for(size_t i=0; i<incl.size(); ++i)
+  {
+    string node = "/augeas/load/Interfaces/incl[" + std::to_string(i+1) + "]";
+    aug_set(aug_, node.c_str(), incl[i].c_str());
+
+    size_t slash = incl[i].rfind('/');
+    if(incl[i][0] != '/' || slash == 0) continue;
+    wanted_[root_ + incl[i].substr(1, slash-1)].push_back(
+        incl[i].substr(slash+1));
+  }
+
+  if(watchFd_ >= 0) watchDirs();
+}
+
+/*
+ * Augeas -- file watching
+ *
+ * Augeas writes files by saving to a temporary and renaming it over the
+ * original, so the watches are placed on the containing directories rather
+ * than on the files themselves. That is /etc/network and the directory of
+ * every file it sources, an event counts if its name matches what is parsed
+ * from that directory.
+ */
+
+void Augeas::watch()
+{
+  watchFd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if(watchFd_ < 0)
+  {
+    LOG(WARNING) << "inotify unavailable, reloading augeas on every call: "
+                 << strerror(errno);
+    return;
+  }
+
+  watchDirs();
+
+  string dir = root_ + "etc/network";
+  bool net = std::any_of(dirs_.begin(), dirs_.end(),
+      [&](const auto & d){ return d.second == dir; });
+  if(!net)
+  {
+    LOG(WARNING) << "failed to watch " << dir << ", reloading augeas on "
+                 << "every call";
+    close(watchFd_);
+    watchFd_ = -1;
+    dirs_.clear();
+  }
+}
+
+//directories that don't exist yet are tried again on the next includes(),
+//or as soon as they show up in a directory that is watched
+void Augeas::watchDirs()
+{
+  for(auto d = dirs_.begin(); d != dirs_.end(); )
+  {
+    if(wanted_.count(d->second)) { ++d; continue; }
+    inotify_rm_watch(watchFd_, d->first);
+    d = dirs_.erase(d);
+  }
+
+  for(const auto & w : wanted_)
+  {
+    bool have = std::any_of(dirs_.begin(), dirs_.end(),
+        [&](const auto & d){ return d.second == w.first; });
+    if(have) continue;
+
+    int wd = inotify_add_watch(watchFd_, w.first.c_str(),
+        IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE);
+    if(wd >= 0) dirs_[wd] = w.first;
+  }
+}
+
+bool Augeas::drain()
+{
+  if(watchFd_ < 0) return true;
+
+  alignas(inotify_event) char buf[4096];
+  bool changed{false}, rewatch{false};
+
+  for(;;)
+  {
+    ssize_t len = read(watchFd_, buf, sizeof(buf));
+    if(len <= 0) break;
+
+    for(char *p = buf; p < buf + len; )
+    {
+      const inotify_event *ev = (const inotify_event*)p;
+      p += sizeof(inotify_event) + ev->len;
+
+      if(ev->mask & IN_Q_OVERFLOW)
+      {
+        changed = true;
+        continue;
+      }
+
+      auto d = dirs_.find(ev->wd);
+      if(d == dirs_.end()) continue;
+
+      //the directory itself went away
+      if(ev->mask & IN_IGNORED)
+      {
+        dirs_.erase(d);
+        changed = true;
+        continue;
+      }
+      if(ev->len == 0) continue;
+
+      string name{ev->name};
+      if((ev->mask & IN_ISDIR) && wanted_.count(d->second + "/" + name))
+      {
+        changed = true;
+        if(ev->mask & (IN_CREATE | IN_MOVED_TO)) rewatch = true;
+        continue;
+      }
+
+      auto w = wanted_.find(d->second);
+      if(w == wanted_.end()) continue;
+      for(const string & pattern : w->second)
+      {
+        if(fnmatch(pattern.c_str(), name.c_str(), FNM_PERIOD) == 0)
+          changed = true;
+      }
+    }
+  }
+
+  if(rewatch) watchDirs();
+  return changed;
 }
@@ -2,7 +2,9 @@
 
 #include <augeas.h>
 #include <vector>
+#include <map>
 #include <string>
+#include <atomic>
 #include <experimental/optional>
 
 namespace deter
@@ -10,7 +12,10 @@ namespace deter
   class Augeas
   {
     public:
-    Augeas();
+    //only the Interfaces lens is loaded and only /etc/network/interfaces and
+    //what it sources are parsed, all relative to root. An empty root leaves
+    //it to augeas, which honours AUGEAS_ROOT and defaults to /
+    explicit Augeas(std::string root = "");
     ~Augeas();
 
     // accessors
@@ -20,12 +25,61 @@ namespace deter
     // modifiers
     void set(std::string path, std::string key, std::string value);
     void clear(std::string path, std::string key);
-    void load();
+    void mv(std::string src, std::string dst);
+
+    // parse the files matching glob as well from the next load on, for
+    // files we write that nothing sources yet
+    void include(std::string glob);
+
+    // load only reparses the tree if the interfaces files have changed on disk
+    // since the last load or save and returns true if it did, reload always
+    // reparses
+    bool load();
+    void reload();
+
+    // write the changed files out, throws with what augeas reported if any
+    // of them could not be written
     void save();
 
-    
+    // true if the interfaces files were changed by someone other than us
+    bool stale();
+
+    // calls into augeas since startup
+    struct Stats
+    {
+      size_t matches{0}, loads{0}, saves{0};
+    };
+    Stats stats() const;
+
+
     private:
       augeas *aug_;
+
+      // point /augeas/load/Interfaces at the interfaces file and whatever
+      // it sources
+      void includes();
+
+      // "path: message" for every error augeas recorded under path
+      std::vector<std::string> errors(std::string path);
+
+      // inotify watches on the directories the interfaces files are in, 
+      // watchDirs adds the ones missing and drops those no longer needed
+      void watch();
+      void watchDirs();
+      bool drain();
+
+      std::string root_;
+      std::vector<std::string> extra_;
+
+      // directory -> file name patterns parsed from it, from includes()
+      std::map<std::string, std::vector<std::string>> wanted_;
+
+      // watch descriptor -> directory
+      std::map<int, std::string> dirs_;
+
+      int watchFd_{-1};
+      bool stale_{true};
+      std::atomic<size_t> matches_{0}, loads_{0}, saves_{0};
   };
 }
 
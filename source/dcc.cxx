@@ -5,6 +5,7 @@
 #include <sstream>
 #include <chrono>
 #include <fstream>
+#include <fnmatch.h>
 #include "dcc.hxx"
 #include "util.hxx"
 #include <fmt/format.h>
@@ -31,19 +32,30 @@ using std::stoul;
 using std::runtime_error;
 namespace chrono = std::chrono;
 using std::milli;
+using std::mutex;
+using std::lock_guard;
+using std::shared_ptr;
 using namespace deter;
 
-/*TODO: we are reloading the augeas cache on every call, this is fairly
- * expensive based on observation. At some point we should use a file
- * watcher to only reload when needed
+/* Augeas::load is cheap to call, it only reparses the interfaces files when
+ * an inotify watch says somebody other than us has changed them
  */
 
 ///
 /// static helpers
 ///
-static bool ifup(string ifx)
+//ifupdown2 orders the interfaces it is given itself, so one call will do
+static bool ifup(const vector<string> & ifxs)
 {
-  auto cr = execl(fmt::format("ifup {}", ifx));
+  string cmd = "ifup";
+  for(const string & ifx : ifxs) cmd += " " + ifx;
+  auto cr = execl(cmd);
+  return (cr.code == 0);
+}
+
+static bool ifreload()
+{
+  auto cr = execl("ifreload -a");
   return (cr.code == 0);
 }
 
@@ -78,6 +90,51 @@ VlanInfo::VlanInfo(size_t did, size_t cid, vector<string> members)
 
 
 
+/* -----------------------------------------------------------------------------
+ *  ~ PortLocks
+ */
+
+PortLocks::Guard PortLocks::lock(vector<string> ifxs)
+{
+  //one global order, so two requests can never each hold what the other 
+  //is waiting for
+  sort(ifxs.begin(), ifxs.end());
+  ifxs.erase(unique(ifxs.begin(), ifxs.end()), ifxs.end());
+
+  Guard g;
+  g.held = hold();
+  g.some = std::shared_lock<std::shared_timed_mutex>{all_};
+
+  vector<mutex*> ms;
+  {
+    lock_guard<mutex> lk{mtx_};
+    for(const string & ifx : ifxs)
+    {
+      auto & m = ports_[ifx];
+      if(!m) m.reset(new mutex);
+      ms.push_back(m.get());
+    }
+  }
+
+  for(mutex *m : ms) g.ports.emplace_back(*m);
+  return g;
+}
+
+PortLocks::Guard PortLocks::lockAll()
+{
+  Guard g;
+  g.held = hold();
+  g.all = std::unique_lock<std::shared_timed_mutex>{all_};
+  return g;
+}
+
+std::shared_ptr<void> PortLocks::hold()
+{
+  ++holders_;
+  return std::shared_ptr<void>{nullptr, [this](void*){ --holders_; }};
+}
+
+
 /* -----------------------------------------------------------------------------
  *  ~ Dcc
  */
@@ -86,130 +143,307 @@ VlanInfo::VlanInfo(size_t did, size_t cid, vector<string> members)
  * Dcc -- Public API
  */
 
-vector<VlanInfo> Dcc::listVlans()
-{
-  LOG(INFO) << "listVlans()";
-  aug_.load();
+Dcc::Dcc(string augRoot) : aug_{augRoot} {}
 
-  //if there is no bridge there are no vlans
-  auto bpo = bridgePath();
-  if(!bpo) return vector<VlanInfo>{};
-  auto bp = *bpo;
+Dcc::~Dcc()
+{
+  {
+    lock_guard<mutex> lk{watchMtx_};
+    stopping_ = true;
+  }
+  watchCv_.notify_all();
+  if(watcher_.joinable()) watcher_.join();
+}
 
-  //get the vlan identifiers from the bridge config
-  string vs = aug_.get(bp + bridge_vids).value_or("");
-  if(vs.empty()) 
+/*
+ * Readers only ever look at the published snapshot, so whatever others 
+ * change in the interfaces files reaches them through the watcher, which 
+ * refreshes like a writer would and publishes.
+ */
+void Dcc::start()
+{
+  if(options.fragments)
   {
-    return vector<VlanInfo>{};
+    lock_guard<mutex> lk{treeMtx_};
+    refresh();
+    if(fragment()) rebuild();
   }
+  snapshot();
+  if(watcher_.joinable()) return;
+
+  watcher_ = thread{[this]
+  {
+    std::unique_lock<mutex> lk{watchMtx_};
+    while(!watchCv_.wait_for(lk, options.reloadInterval, 
+          [this]{ return stopping_; }))
+    {
+      lock_guard<mutex> tl{treeMtx_};
+      try { refresh(); }
+      catch(std::exception &e) { LOG(ERROR) << "reload: " << e.what(); }
+    }
+  }};
+}
+
+vector<VlanInfo> Dcc::listVlans()
+{
+  LOG(INFO) << "listVlans()";
+  auto state = snapshot();
 
   using namespace pipes;
 
+  //if there is no bridge there are no vlans
   return
-  split(vs, ' ') 
-    | map([&](const string & v)
+  state->vlans()
+    | map([&](size_t id)
       { 
-        size_t id = stoul(v);
-        return VlanInfo{id, vlanMembers(id)};
+        return VlanInfo{id, state->vlanMembers(id)};
       });
 }
 
-void Dcc::disablePortTrunking(string ifx, bool finalize)
+/*
+ * Trunking is switched per port and an unknown port is not an exception 
+ * here, either call hands back an empty result and the caller reports it.
+ */
+optional<ApplyResult> Dcc::disablePortTrunking(string ifx)
 {
-  LOG(INFO) << "diablePortTrunking(" << ifx << ")";
-  aug_.load();
-  auto result = aug_.match(fmt::format("{}/iface[ . = '{}' ]", ifx_path, ifx));
-  if(result.empty()) 
-  {
-    LOG(ERROR) << "could not find interface " << ifx;
-  }
+  LOG(INFO) << "disablePortTrunking(" << ifx << ")";
+  if(!hasPort(ifx)) return optional<ApplyResult>{};
 
-  aug_.set(result[0], "bridge-allow-untagged", "yes");
-  aug_.clear(result[0], "brige-vids");
+  BatchOp op{BatchOp::Kind::DisablePortTrunking, {ifx}, {}};
+  auto ports = locks_.lock({ifx});
+  bool found{false};
+  auto r = mutate([&]{ found = edit(op); });
 
-  if(finalize)
-  {
-    aug_.save();
-    ifup(ifx);
-  }
+  if(!found) return optional<ApplyResult>{};
+  return make_optional(r);
 }
 
 
-bool Dcc::enablePortTrunking(string ifx, size_t vlan_id, bool /*eq_trunk*/)
+optional<ApplyResult> 
+Dcc::enablePortTrunking(string ifx, size_t vlan_id, bool /*eq_trunk*/)
 {
   LOG(INFO) << "enablePortTrunking("
     << ifx << ","
     << vlan_id << ")";
+  if(!hasPort(ifx)) return optional<ApplyResult>{};
+
+  BatchOp op{BatchOp::Kind::EnablePortTrunking, {ifx}, {vlan_id}};
+  check("enablePortTrunking", op, *snapshot());
+  auto ports = locks_.lock({ifx});
+  bool found{false};
+  auto r = mutate([&]{ found = edit(op); });
 
-  aug_.load();
-  auto result = aug_.match(fmt::format("{}/iface[ . = '{}' ]", ifx_path, ifx));
-  if(result.empty()) 
+  if(!found) return optional<ApplyResult>{};
+  return make_optional(r);
+}
+
+bool Dcc::hasPort(const string & ifx)
+{
+  auto state = snapshot();
+  if(state->ports.find(ifx) != state->ports.end()) return true;
+  LOG(ERROR) << "could not find interface " << ifx;
+  return false;
+}
+
+
+/*
+ * The tree edits behind the mutators and batch, callers hold treeMtx_. 
+ * Returns false if the operation did not apply because its port is missing.
+ */
+bool Dcc::edit(const BatchOp & op)
+{
+  using K = BatchOp::Kind;
+  switch(op.kind)
   {
-    LOG(ERROR) << "could not find interface " << ifx;
-    return false;
-  }
+    case K::DisablePortTrunking:
+    {
+      const string & ifx = op.ports.at(0);
+      auto path = findIfx(ifx);
+      if(!path) 
+      {
+        LOG(ERROR) << "could not find interface " << ifx;
+        return false;
+      }
+
+      touch(ifx);
+      aug_.set(*path, "bridge-allow-untagged", "yes");
+      aug_.clear(*path, "bridge-vids");
+      state_.setTrunked(ifx, false);
+      state_.setVids(ifx, {});
+      return true;
+    }
 
-  aug_.set(result[0], "bridge-allow-untagged", "no");
+    case K::EnablePortTrunking:
+    {
+      const string & ifx = op.ports.at(0);
+      auto path = findIfx(ifx);
+      if(!path) 
+      {
+        LOG(ERROR) << "could not find interface " << ifx;
+        return false;
+      }
+
+      touch(ifx);
+      aug_.set(*path, "bridge-allow-untagged", "no");
+      state_.setTrunked(ifx, true);
+
+      //migrate access vids to trunk vids
+      VlanSet vs{op.vlans.at(0)};
+      auto existing = aug_.get(*path + bridge_access);
+      if(existing) vs |= parseVlist(*existing);
+      aug_.set(*path, "bridge-vids", emitVlist(vs));
+      state_.setVids(ifx, vs);
+      return true;
+    }
 
-  //migrate access vids to trunk vids
-  string path={result[0]+"/bridge-access"};
-  auto _existing = aug_.get(path);
-  string existing{""};
-  if(_existing) {
-    existing = *_existing + " ";
-  }
-  existing += to_string(vlan_id);
-  aug_.set(result[0], "bridge-vids", existing);
+    case K::SetVlansOnTrunk:
+      setIfxVids(op.ports.at(0), VlanSet{op.vlans}, op.allow);
+      setIfxVids("bridge", VlanSet{op.vlans}, op.allow);
+      return true;
 
+    case K::RemoveVlans:
+    {
+      auto bpo = bridgePath();
+      if(!bpo) return true;
+      auto bp = *bpo;
+      
+      unlinkVlans(op.vlans);
+
+      auto bridgeVids = aug_.get(bp+"/bridge-vids");
+      VlanSet vs;
+      if(bridgeVids) vs = parseVlist(*bridgeVids);
+      vs -= VlanSet{op.vlans};
+      touch("bridge");
+      if(!vs.empty())
+      {
+        auto value = emitVlist(vs);
+        aug_.set(bp, "bridge-vids", value);
+      }
+      else
+      {
+        aug_.clear(bp, "bridge-vids");
+      }
+      state_.setVids("bridge", vs);
+      return true;
+    }
 
-  aug_.save();
+    case K::RemovePortsFromVlan:
+      unlinkVlans(op.vlans);
+      return true;
 
-  ifup(ifx);
-  
-  return true;
-}
+    case K::SetPortVlan:
+    {
+      size_t vlan = op.vlans.at(0);
+      for(const string & ifx : op.ports)
+      {
+        if(isTrunk(ifx))
+        {
+          LOG(INFO) << ifx << " trunk("<<vlan<<")";
+          setIfxVids(ifx, {vlan}, true);
+        }
+        else
+        {
+          LOG(INFO) << ifx << " access("<<vlan<<")";
+          setBridgeAccess(ifx, vlan);
+        }
+        setIfxVids("bridge", {vlan}, true);
+      }
+      return true;
+    }
 
+    case K::DelPortVlan:
+      for(const string & ifx : op.ports)
+      {
+        removeBridgeAccess(ifx, op.vlans.at(0));
+        removeBridgeVid(ifx, op.vlans.at(0));
+      }
+      return true;
 
-void Dcc::setIfxVids(string ifx, vector<size_t> vlans, bool allow)
+    case K::RemoveSomePortsFromVlan:
+      for(const string & ifx : op.ports)
+      {
+        removeBridgeVid(ifx, op.vlans.at(0));
+        removeBridgeAccess(ifx, op.vlans.at(0));
+      }
+      return true;
+  }
+
+  return false;
+}
+
+//throws describing what is wrong with op, what says where it came from
+void Dcc::check(const string & what, const BatchOp & op, 
+    const SwitchState & state)
 {
-  auto path = ifxPath(ifx);
-  auto existingVlans = aug_.get(path+"/bridge-vids");
-  vector<size_t> vs;
-  if(existingVlans) { vs = parseVlist(*existingVlans); }
+  using K = BatchOp::Kind;
+  auto fail = [&what](string why)
+  {
+    throw runtime_error{what + ": " + why};
+  };
 
-  if(allow) 
+  size_t nports{0}, nvlans{0};
+  switch(op.kind)
   {
-    for(auto v : vlans) addVlan(v, vs);
+    case K::DisablePortTrunking: nports = 1; break;
+    case K::EnablePortTrunking: nports = 1; nvlans = 1; break;
+    case K::SetVlansOnTrunk: nports = 1; break;
+    case K::RemoveVlans: break;
+    case K::RemovePortsFromVlan: break;
+    case K::SetPortVlan:
+    case K::DelPortVlan:
+    case K::RemoveSomePortsFromVlan: nvlans = 1; break;
   }
-  else
+
+  if(nports && op.ports.size() != nports) 
+    fail(fmt::format("expected {} port(s)", nports));
+  if(nvlans && op.vlans.size() != nvlans) 
+    fail(fmt::format("expected {} vlan(s)", nvlans));
+
+  for(const string & ifx : op.ports)
   {
-    for(auto v : vlans) { removeVlan(v, vs); }
+    if(state.ports.find(ifx) == state.ports.end()) 
+      fail("no such interface " + ifx);
   }
+  for(size_t v : op.vlans)
+  {
+    if(v < 1 || v > 4094) fail(fmt::format("invalid vlan {}", v));
+  }
+}
+
+void Dcc::setIfxVids(string ifx, const VlanSet & vlans, bool allow)
+{
+  auto path = ifxPath(ifx);
+  auto existingVlans = aug_.get(path+"/bridge-vids");
+  VlanSet vs;
+  if(existingVlans) { vs = parseVlist(*existingVlans); }
+
+  if(allow) vs |= vlans;
+  else vs -= vlans;
 
   auto value = emitVlist(vs);
 
   LOG(INFO) << ifx << " vlans: " << value;
 
+  touch(ifx);
   aug_.set(path, "bridge-vids", value);
+  state_.setVids(ifx, vs);
 
 }
 
-void Dcc::setVlansOnTrunk(string ifx, vector<size_t> vlans, bool allow)
+ApplyResult Dcc::setVlansOnTrunk(string ifx, vector<size_t> vlans, bool allow)
 {
   LOG(INFO) << "setVlansOnTrunk("
     << ifx << ","
     << "[...],"
     << allow << ")";
 
-  aug_.load();
+  BatchOp op{BatchOp::Kind::SetVlansOnTrunk, {ifx}, vlans, allow};
+  check("setVlansOnTrunk", op, *snapshot());
 
-  setIfxVids(ifx, vlans, allow);
-  setIfxVids("bridge", vlans, allow);
-
-  aug_.save();
-  
-  ifup(ifx);
-  ifup("bridge");
+  //taking vlans off the bridge can't be ordered against ports adding them 
+  //without holding everything
+  auto ports = allow ? locks_.lock({ifx}) : locks_.lockAll();
+  return mutate([&]{ edit(op); });
 }
 
 
@@ -218,28 +452,24 @@ vector<pair<size_t, optional<size_t>>> Dcc::findVlans(vector<size_t> ids)
   LOG(INFO) << "findVlans([...])";
 
   using namespace pipes;
-  auto vlanInfo = listVlans();
+  auto state = snapshot();
 
+  //deter and cumulus ids are the same thing as far as the switch knows
   if(ids.empty())
   {
-    return vlanInfo 
-      | map([](const VlanInfo &v) 
+    return state->vlans()
+      | map([](size_t v) 
         { 
-          return make_pair(v.cumulusId, make_optional(v.deterId)); 
+          return make_pair(v, make_optional(v)); 
         });
   }
 
   return
   ids 
-    | map([&vlanInfo](size_t id)
+    | map([&](size_t id)
       {
         auto result = make_pair(id, optional<size_t>{});
-        auto i = 
-        find_if(vlanInfo.begin(), vlanInfo.end(), 
-          [id](const VlanInfo & v){ return v.cumulusId == id; });
-
-        if(i != vlanInfo.end()) result.second = i->deterId;
-
+        if(state->hasVlan(id)) result.second = id;
         return result;
       });
 }
@@ -248,58 +478,65 @@ bool Dcc::vlanHasPorts(size_t vlan_id)
 {
   LOG(INFO) << "vlanHasPorts(" << vlan_id << ")";
 
-  aug_.load();
-  auto vs = listVlans();
-  for(const auto & v : vs)
-  {
-    if(v.cumulusId == vlan_id && !v.members.empty()) return true;
-  }
-  return false;
+  auto state = snapshot();
+  if(!state->hasVlan(vlan_id)) return false;
+
+  auto i = state->members.find(vlan_id);
+  return i != state->members.end() && !i->second.empty();
 }
 
-void Dcc::updateActiveInterfaces()
+uint64_t Dcc::version()
 {
-  using namespace pipes;
+  snapshot();
+  return version_;
+}
 
-  aug_.match("/files/etc/network/interfaces/iface")
-    | for_each([this](const string &x){ activeIfxs_.insert(*aug_.get(x)); });
+Metrics Dcc::metrics()
+{
+  auto a = aug_.stats();
+
+  Metrics m;
+  m.mutations = mutations_;
+  m.commits = commits_;
+  m.augMatches = a.matches;
+  m.augLoads = a.loads;
+  m.augSaves = a.saves;
+  return m;
 }
 
+
 vector<Interface> Dcc::getInterfaces()
 {
   LOG(INFO) << "getInterfaces()";
 
-  updateActiveInterfaces();
+  auto state = snapshot();
 
   vector<Interface> ixs;
 
-  auto response = NetLink::getLink();
-  for(const auto & m : response.messages)
+  //served from the link monitor's table when it is running
+  for(const auto & l : NetLink::links())
   {
     Interface ix;
-    auto name = m.getAttribute<string>(IFLA_IFNAME);
+    const string & name = l.name;
     ix.name = name;
+    ix.mac = l.mac;
+    ix.duplex = l.duplex;
     
     //only care about physical interfaces
     //if(name.compare(0, 3, "swp") != 0)
-    if(name == "bridge" || activeIfxs_.find(name) == activeIfxs_.end())
+    if(name == "bridge" || state->ports.find(name) == state->ports.end())
     {
       continue;
     }
 
-    //TODO it seems we may not even need this, linkSpeed
-    //will report the speed even when the link is down if
-    //the module is indeed plugged in and it also does
-    //not require root for the SIOCETHTOOL ioctl which is nice
-    //ix.capSpeed = NetLink::capSpeed(name);
-    //
-    //also reading the modlue information off the eeprom
-    //is slow as a turd, so not having to do that is nice
-    
+    //the module eeprom is slow as a turd to read, the link monitor reads it
+    //once per module insertion and keeps the result
+    ix.capSpeed = l.module.capSpeed;
+
     //yeah its gross, fix later
     if(name.compare(0, 3, "swp") == 0)
     {
-      ix.linkSpeed = NetLink::linkSpeed(name);
+      ix.linkSpeed = l.speed;
     }
     else if(name.compare(0, 4, "leaf") == 0)
     {
@@ -314,80 +551,94 @@ vector<Interface> Dcc::getInterfaces()
       ix.linkSpeed = 40000*2;
     }
 
-    ix.enabled = ((m.ifInfo()->ifi_flags & IFF_UP) != 0);
-    ix.link = ((m.ifInfo()->ifi_flags & IFF_LOWER_UP) != 0);
+    ix.enabled = ((l.flags & IFF_UP) != 0);
+    ix.link = ((l.flags & IFF_LOWER_UP) != 0);
 
     ixs.push_back(ix);
   }
-  
-  close(response.fd);
 
   return ixs;
 }
 
-void Dcc::removeVlans(vector<size_t> vlans)
+vector<PortStats> Dcc::portStats(vector<string> ifxs, bool delta)
 {
-  LOG(INFO) << "removeVlans(...)";
-  for(size_t v : vlans) { LOG(INFO) << "\t" << v; }
+  auto state = snapshot();
 
-  aug_.load();
+  auto now = chrono::steady_clock::now();
+  auto since = [](uint64_t x, uint64_t y) { return x >= y ? x - y : x; };
 
-  auto bpo = bridgePath();
-  if(!bpo) return;
-  auto bp = *bpo;
-  
-  removePortsFromVlan(vlans, false);
-
-  auto bridgeVids = aug_.get(bp+"/bridge-vids");
-  vector<size_t> vs;
-  if(bridgeVids) vs = parseVlist(*bridgeVids);
-  for(size_t vlan : vlans)
-  {
-    removeVlan(vlan, vs);
-  }
-  if(!vs.empty())
-  {
-    auto value = emitVlist(vs);
-    aug_.set(bp, "bridge-vids", value);
-  }
-  else
+  vector<PortStats> pss;
+  for(const auto & ls : NetLink::stats())
   {
-    aug_.clear(bp, "bridge-vids");
-  }
+    const string & name = ls.name;
+    if(name == "bridge" || state->ports.find(name) == state->ports.end())
+      continue;
+    if(!ifxs.empty() && 
+       std::find(ifxs.begin(), ifxs.end(), name) == ifxs.end())
+      continue;
 
-  aug_.save();
+    const auto & c = ls.counters;
+    PortStats ps;
+    ps.name = name;
+    ps.rxBytes = c.rx_bytes;
+    ps.txBytes = c.tx_bytes;
+    ps.rxPackets = c.rx_packets;
+    ps.txPackets = c.tx_packets;
+    ps.rxErrors = c.rx_errors;
+    ps.txErrors = c.tx_errors;
+    ps.rxDropped = c.rx_dropped;
+    ps.txDropped = c.tx_dropped;
+
+    //every sample is remembered, so a delta is always against the most 
+    //recent call that looked at the port whatever its mode
+    StatsSample sample{now, ps};
+    lock_guard<mutex> lk{statsMtx_};
+    auto prev = lastStats_.find(name);
+    if(delta && prev != lastStats_.end())
+    {
+      //counters going backwards means the port was recreated, count from 0
+      const auto & p = prev->second.stats;
+      ps.rxBytes = since(ps.rxBytes, p.rxBytes);
+      ps.txBytes = since(ps.txBytes, p.txBytes);
+      ps.rxPackets = since(ps.rxPackets, p.rxPackets);
+      ps.txPackets = since(ps.txPackets, p.txPackets);
+      ps.rxErrors = since(ps.rxErrors, p.rxErrors);
+      ps.txErrors = since(ps.txErrors, p.txErrors);
+      ps.rxDropped = since(ps.rxDropped, p.rxDropped);
+      ps.txDropped = since(ps.txDropped, p.txDropped);
+      ps.interval = 
+        chrono::duration<double>(now - prev->second.at).count();
+    }
+    lastStats_[name] = sample;
 
-  ifup("bridge");
-  
+    pss.push_back(ps);
+  }
+
+  return pss;
 }
 
-void Dcc::removePortsFromVlan(vector<size_t> vlans, bool load_save)
+ApplyResult Dcc::removeVlans(vector<size_t> vlans)
 {
-  LOG(INFO) << "removePortsFromVlan([...],"<<load_save<<")";
-  if(load_save) aug_.load();
-
-  vector<string> toCycle;  
-  for(const auto v : vlans)
-  {
-    auto members = vlanMembers(v, false);
-    for(const auto ifx : members)
-    {
-      removeBridgeVid(ifx, v);
-      removeBridgeAccess(ifx, v);
-      toCycle.push_back(ifx);
-    }
-  }
+  LOG(INFO) << "removeVlans(...)";
+  for(size_t v : vlans) { LOG(INFO) << "\t" << v; }
 
-  aug_.save();
+  BatchOp op{BatchOp::Kind::RemoveVlans, {}, vlans};
+  check("removeVlans", op, *snapshot());
+  auto ports = locks_.lockAll();
+  return mutate([&]{ edit(op); });
+}
 
-  for(const string & ifx : toCycle)
-  {
-    ifup(ifx);
-  }
+ApplyResult Dcc::removePortsFromVlan(vector<size_t> vlans)
+{
+  LOG(INFO) << "removePortsFromVlan([...])";
+  BatchOp op{BatchOp::Kind::RemovePortsFromVlan, {}, vlans};
+  check("removePortsFromVlan", op, *snapshot());
+  auto ports = locks_.lockAll();
+  return mutate([&]{ edit(op); });
 }
 
 
-void Dcc::setPortVlan(vector<string> ifxs, size_t vlan)
+ApplyResult Dcc::setPortVlan(vector<string> ifxs, size_t vlan)
 {
   LOG(INFO) << "setPortVlan([...]," << vlan << ")";
   for(const string ifx : ifxs)
@@ -395,92 +646,181 @@ void Dcc::setPortVlan(vector<string> ifxs, size_t vlan)
     LOG(INFO) << "ifx=" << ifx;
   }
 
-  for(const string ifx : ifxs)
-  {
-    if(isTrunk(ifx))
-    {
-      LOG(INFO) << ifx << " trunk("<<vlan<<")";
-      setIfxVids(ifx, {vlan}, true);
-    }
-    else
-    {
-      LOG(INFO) << ifx << " access("<<vlan<<")";
-      setBridgeAccess(ifx, vlan);
-    }
-    setIfxVids("bridge", {vlan}, true);
-  }
-
-  aug_.save();
-
-  for(const string ifx : ifxs)
-  {
-    ifup(ifx);
-  }
-  ifup("bridge");
+  BatchOp op{BatchOp::Kind::SetPortVlan, ifxs, {vlan}};
+  check("setPortVlan", op, *snapshot());
+  auto ports = locks_.lock(ifxs);
+  return mutate([&]{ edit(op); });
 }
 
-static bool isDownlink(string ifx)
+ApplyResult Dcc::delPortVlan(vector<string> ifxs, size_t vlan)
 {
- regex rx{"^swp[1-9][0-9]?s[0-3]$"};
- smatch s;
- return regex_match(ifx, s, rx);
+  LOG(INFO) << "delPortVlan([...]," << vlan << ")";
+  BatchOp op{BatchOp::Kind::DelPortVlan, ifxs, {vlan}};
+  check("delPortVlan", op, *snapshot());
+  auto ports = locks_.lock(ifxs);
+  return mutate([&]{ edit(op); });
+}
+      
+ApplyResult Dcc::removeSomePortsFromVlan(size_t vlan, vector<string> ifxs)
+{
+  LOG(INFO) << "removeSomePortsFromVlan(" << vlan << ",[...])";
+  BatchOp op{BatchOp::Kind::RemoveSomePortsFromVlan, ifxs, {vlan}};
+  check("removeSomePortsFromVlan", op, *snapshot());
+  auto ports = locks_.lock(ifxs);
+  return mutate([&]{ edit(op); });
 }
 
-void Dcc::delPortVlan(vector<string> ifxs, size_t vlan)
+/*
+ * All or nothing. Every operation is checked against the current tree
+ * before any of them is applied, so a bad port or vlan anywhere in the 
+ * batch leaves the switch untouched. Should an edit fail anyway the tree is
+ * reloaded from disk, which still holds what was there before the batch.
+ *
+ * A batch does not join a group commit, a failure would take the edits of
+ * the other members down with it.
+ */
+ApplyResult Dcc::batch(const vector<BatchOp> & ops)
 {
-  LOG(INFO) << "delPortVlan([...]," << vlan << ")";
+  LOG(INFO) << "batch(" << ops.size() << " ops)";
 
-  for(const string & ifx : ifxs)
+  bool all{false};
+  vector<string> ifxs;
+  for(const auto & op : ops)
   {
-    removeBridgeAccess(ifx, vlan);
-    removeBridgeVid(ifx, vlan);
+    all |= op.kind == BatchOp::Kind::RemoveVlans ||
+           op.kind == BatchOp::Kind::RemovePortsFromVlan ||
+           (op.kind == BatchOp::Kind::SetVlansOnTrunk && !op.allow);
+    ifxs.insert(ifxs.end(), op.ports.begin(), op.ports.end());
   }
+  auto ports = all ? locks_.lockAll() : locks_.lock(ifxs);
 
-  aug_.save();
-
-  for(const string & ifx : ifxs)
+  Changes cs;
+  size_t matches;
+  std::unique_lock<mutex> uplinks;
   {
-    ifup(ifx);
+    lock_guard<mutex> lk{treeMtx_};
+    matches = aug_.stats().matches;
+    refresh();
+
+    for(size_t i=0; i<ops.size(); ++i) 
+      check(fmt::format("batch op {}", i), ops[i], state_);
+
+    try
+    {
+      for(size_t i=0; i<ops.size(); ++i)
+      {
+        if(!edit(ops[i]))
+          throw runtime_error{fmt::format("batch op {} failed", i)};
+      }
+      if(options.pruneUplinks && prune()) 
+        uplinks = std::unique_lock<mutex>{uplinkMtx_};
+      cs = commit();
+      matches = aug_.stats().matches - matches;
+    }
+    catch(...)
+    {
+      LOG(ERROR) << "batch failed, rolling back";
+      rollback();
+      throw;
+    }
   }
+
+  ++mutations_;
+  ++commits_;
+  auto r = apply(cs);
+  r.augMatches = matches;
+  return r;
 }
       
-void Dcc::removeSomePortsFromVlan(size_t vlan, vector<string> ifxs)
+ApplyResult Dcc::syncUplinks()
 {
-  LOG(INFO) << "removeSomePortsFromVlan(" << vlan << ",[...])";
-  aug_.load();
-  for(const string & ifx : ifxs)
+  LOG(INFO) << "syncUplinks()";
+  return mutate([this]{ prune(); });
+}
+
+/*
+ * Uplink pruning. The uplinks of a leaf only need the vlans some downlink of
+ * the leaf is in, anything more floods broadcasts and unknown unicast of 
+ * experiments that are not on the leaf into the fabric. Rather than having
+ * every mutator reason about the uplinks, each commit recomputes the union 
+ * of the downlink vlans and sets it on every uplink that differs, commit
+ * then records only the uplinks that changed and apply programs the vlans
+ * that came or went. An uplink without bridge-vids inherits every vlan of
+ * the bridge, so uplinkKeep (the default vlan) keeps the set from emptying
+ * and should it be empty anyway the uplinks are left as they are.
+ */
+bool Dcc::prune()
+{
+  VlanSet want = options.uplinkKeep;
+  vector<string> ups;
+  for(const auto & p : state_.ports)
   {
-    removeBridgeVid(ifx, vlan);
-    removeBridgeAccess(ifx, vlan);
+    if(regex_match(p.first, options.downlinks))
+    {
+      want |= p.second.vids;
+      if(p.second.access && *p.second.access < VlanSet::Max) 
+        want.add(*p.second.access);
+    }
+    else if(regex_match(p.first, options.uplinks)) ups.push_back(p.first);
   }
-  aug_.save();
-  for(const string & ifx : ifxs)
+
+  if(want.empty())
+  {
+    LOG(WARNING) << "no vlans for the uplinks, leaving them as they are";
+    return false;
+  }
+
+  bool changed{false};
+  for(const string & ifx : ups)
   {
-    ifup(ifx);
+    if(state_.ports[ifx].vids == want) continue;
+
+    auto path = ifxPath(ifx);
+    touch(ifx);
+    aug_.set(path, "bridge-vids", emitVlist(want));
+    state_.setVids(ifx, want);
+    changed = true;
   }
+
+  if(changed) LOG(INFO) << "uplink vlans: " << emitVlist(want);
+  return changed;
 }
       
-void Dcc::portControl(PortControlCommand cmd, vector<string> ifxs)
+std::map<string, string> 
+Dcc::portControl(PortControlCommand cmd, vector<string> ifxs)
 {
   LOG(INFO) << "portControl("<<cmd<<",[...])";
   using C = PortControlCommand;
+
+  //admin state changes go out as a single netlink batch
+  if(cmd == C::Enable || cmd == C::Disable)
+  {
+    return NetLink::setIfxsUp(ifxs, cmd == C::Enable);
+  }
+
+  std::map<string, string> errors;
   for(const string & ifx : ifxs)
   {
-    switch(cmd)
+    try
     {
-      case C::Enable: NetLink::enableIfx(ifx); break;
-      case C::Disable: NetLink::disableIfx(ifx); break;
-      case C::Speed100G: NetLink::setIfxSpeed(ifx, SPEED_1000000); break;
-      case C::Speed40G: NetLink::setIfxSpeed(ifx, SPEED_40000); break;
-      case C::Speed10G: NetLink::setIfxSpeed(ifx, SPEED_10000); break;
-      case C::Speed1G: NetLink::setIfxSpeed(ifx, SPEED_1000); break;
-      case C::Speed100M: NetLink::setIfxSpeed(ifx, SPEED_100); break;
-      case C::Speed10M: NetLink::setIfxSpeed(ifx, SPEED_10); break;
-      case C::DuplexFull: NetLink::setIfxDuplex(ifx, DUPLEX_FULL); break;
-      case C::DuplexHalf: NetLink::setIfxDuplex(ifx, DUPLEX_HALF); break;
-      case C::DuplexAuto: NetLink::setIfxDuplex(ifx, DUPLEX_UNKNOWN); break;
+      switch(cmd)
+      {
+        case C::Enable: NetLink::enableIfx(ifx); break;
+        case C::Disable: NetLink::disableIfx(ifx); break;
+        case C::Speed100G: NetLink::setIfxSpeed(ifx, SPEED_1000000); break;
+        case C::Speed40G: NetLink::setIfxSpeed(ifx, SPEED_40000); break;
+        case C::Speed10G: NetLink::setIfxSpeed(ifx, SPEED_10000); break;
+        case C::Speed1G: NetLink::setIfxSpeed(ifx, SPEED_1000); break;
+        case C::Speed100M: NetLink::setIfxSpeed(ifx, SPEED_100); break;
+        case C::Speed10M: NetLink::setIfxSpeed(ifx, SPEED_10); break;
+        case C::DuplexFull: NetLink::setIfxDuplex(ifx, DUPLEX_FULL); break;
+        case C::DuplexHalf: NetLink::setIfxDuplex(ifx, DUPLEX_HALF); break;
+        case C::DuplexAuto: NetLink::setIfxDuplex(ifx, DUPLEX_UNKNOWN); break;
+      }
     }
+    catch(runtime_error &e) { errors[ifx] = e.what(); }
   }
+  return errors;
 }
 
 /*
@@ -490,119 +830,227 @@ void Dcc::portControl(PortControlCommand cmd, vector<string> ifxs)
 const std::string 
   Dcc::bridge_vids{"/bridge-vids"},
   Dcc::bridge_access{"/bridge-access"},
-  Dcc::ifx_path{"/files/etc/network/interfaces"};
+  Dcc::ifx_path{"/files/etc/network/interfaces"},
+  Dcc::frag_path{"/files/etc/network/interfaces.d"},
+  Dcc::frag_glob{"/etc/network/interfaces.d/*.intf"};
 
-vector<string> Dcc::vlanMembers(size_t vid, bool doLoad)
+//iface stanzas matching pred, wherever ifupdown would find them
+string Dcc::ifaces(string pred)
 {
-  using namespace pipes;
-  
-  if(doLoad) { aug_.load(); }
-
-  string path = fmt::format(
-      "{}/*{}[ . =~ regexp('.*{}.*') ]", 
-      ifx_path, 
-      bridge_vids, 
-      vid
-  );
-  auto trunk_members = aug_.match(path)
-    | map([&](const string &s){ return erase(s, bridge_vids); })
-    | collect([&](const auto &x){ return aug_.get(x); })
-    | filter([](const string &x) { return x == "bridge"; });
-
-
-  path = fmt::format(
-      "{}/*{}[ . = '{}' ]",
-      ifx_path,
-      bridge_access,
-      vid
-  );
-  
-  auto access_members = aug_.match(path)
-    | map([&](const string &s){ return erase(s, bridge_access); })
-    | collect([&](const auto &x){ return aug_.get(x); });
+  return fmt::format("{0}/iface{2} | {1}/*/iface{2}", 
+      ifx_path, frag_path, pred);
+}
+
+void Dcc::refresh()
+{
+  if(options.fragments) aug_.include(frag_glob);
+  if(!aug_.load()) return;
+  rebuild();
+}
 
+/*
+ * Fragment layout. Every iface dcc edits, the bridge and its ports, lives
+ * by itself in interfaces.d/<name>.intf, so saving a change to one port
+ * rewrites a file of a few lines rather than all of interfaces. Augeas 
+ * writes each file to a temporary and renames it into place. The stanzas
+ * are moved out of the main file once, by start(), and ones put back by hand
+ * later are edited where they are. The auto lines stay where they are.
+ *
+ * A name with more than one stanza, in the main file or already in a 
+ * fragment too, is left alone. There is no telling which of them is meant
+ * and moving one would overwrite or reorder the other.
+ */
+bool Dcc::fragment()
+{
+  vector<string> names, dups;
+  for(const string & path : aug_.match(ifx_path + "/iface"))
+  {
+    auto name = aug_.get(path);
+    if(!name) continue;
 
-  //append access members to trunk members for return value
-  trunk_members.insert(
-      trunk_members.end(), 
-      access_members.begin(), 
-      access_members.end()
-  );
+    bool managed = *name == "bridge" ||
+      aug_.get(path+"/bridge-allow-untagged") || 
+      aug_.get(path+bridge_access) || 
+      aug_.get(path+bridge_vids);
+    if(!managed) continue;
 
-  return trunk_members;
-};
+    if(aug_.match(ifaces(fmt::format("[ . = '{}' ]", *name))).size() > 1)
+    {
+      if(std::find(dups.begin(), dups.end(), *name) == dups.end())
+        LOG(WARNING) << *name << " has more than one stanza, not moving it";
+      dups.push_back(*name);
+      continue;
+    }
+    names.push_back(*name);
+  }
+  if(names.empty()) return false;
 
-vector<size_t> Dcc::parseVlist(string s)
-{
-  using namespace pipes;
-  vector<string> vs = split(s, ' ');
-  auto result = vs | map([](const string &x) -> size_t { return stoul(x); });
-  return result;
+  auto start = chrono::steady_clock::now();
+
+  //moving shifts the positions of the stanzas after it, go by name
+  for(const string & name : names)
+  {
+    aug_.mv(fmt::format("{}/iface[ . = '{}' ]", ifx_path, name),
+        fmt::format("{}/{}.intf/iface", frag_path, name));
+  }
+
+  string probe = frag_glob.substr(0, frag_glob.rfind('/')) + "/bridge.intf";
+  bool sourced{false};
+  for(const string & path : aug_.match(ifx_path + "/source"))
+  {
+    auto glob = aug_.get(path);
+    sourced |= 
+      glob && fnmatch(glob->c_str(), probe.c_str(), FNM_PATHNAME) == 0;
+  }
+  if(!sourced) aug_.set(ifx_path, "source[last()+1]", frag_glob);
+
+  aug_.save();
+  aug_.reload();
+
+  LOG(INFO) << "moved " << names.size() << " stanzas to " << frag_glob 
+            << " in " 
+            << chrono::duration<double, milli>(
+                chrono::steady_clock::now() - start).count()
+            << " ms";
+  return true;
 }
 
-void Dcc::addVlan(size_t v, vector<size_t> & vs)
+/*
+ * The files may have been edited by hand. A value that does not parse is 
+ * logged and left out of the model rather than failing the whole load, the 
+ * port then looks like it has no access vlan or no vids of its own.
+ */
+void Dcc::rebuild()
 {
-  if(find(vs.begin(), vs.end(), v) == vs.end())
+  SwitchState s;
+  paths_.clear();
+  for(const string & path : aug_.match(ifaces()))
   {
-    vs.push_back(v);
+    auto name = aug_.get(path);
+    if(!name) continue;
+    paths_.emplace(*name, path);
+
+    PortState p;
+    auto allow_untagged = aug_.get(path+"/bridge-allow-untagged");
+    p.trunked = allow_untagged && *allow_untagged == "no";
+
+    auto access = aug_.get(path+bridge_access);
+    if(access)
+    {
+      size_t vid{0}, end{0};
+      try { vid = stoul(*access, &end); }
+      catch(std::exception &) { end = 0; }
+      if(end == access->size() && vid > 0 && vid < VlanSet::Max) 
+        p.access = vid;
+      else 
+        LOG(WARNING) << *name << ": ignoring bridge-access " << *access;
+    }
+
+    auto vids = aug_.get(path+bridge_vids);
+    if(vids)
+    {
+      try { p.vids = parseVlist(*vids); }
+      catch(std::exception &) 
+      { 
+        LOG(WARNING) << *name << ": ignoring bridge-vids " << *vids;
+      }
+    }
+
+    s.ports[*name] = p;
   }
+  s.reindex();
+
+  state_ = s;
+  publish();
 }
 
-void Dcc::removeVlan(size_t v, vector<size_t> & vs)
+/*
+ * Readers never wait for a writer and never go to augeas. Writers refresh
+ * on their way in and the watcher started by start() picks up changes made
+ * by others. Only the very first call loads the tree, for a Dcc that was
+ * not started.
+ */
+shared_ptr<const SwitchState> Dcc::snapshot()
 {
-  auto i = find(vs.begin(), vs.end(), v);
-  if(i != vs.end()) vs.erase(i);
+  std::call_once(loaded_, [this]
+  {
+    lock_guard<mutex> lk{treeMtx_};
+    refresh();
+  });
+  return std::atomic_load(&snapshot_);
 }
 
-optional<string> Dcc::bridgePath()
+void Dcc::publish()
 {
-  auto path = aug_.match(fmt::format("{}/iface[ . = 'bridge' ]", ifx_path));
-  if(path.empty()) return optional<string>{};
-  else 
+  std::atomic_store(&snapshot_, 
+      std::make_shared<const SwitchState>(state_));
+
+  //after the store, a reader that sees the new version sees the new state
+  ++version_;
+}
+
+void Dcc::unlinkVlans(const vector<size_t> & vlans)
+{
+  for(const auto v : vlans)
   {
-    string s = path[0];
-    return make_optional(s);
+    auto members = vlanMembers(v, false);
+    for(const auto & ifx : members)
+    {
+      removeBridgeVid(ifx, v);
+      removeBridgeAccess(ifx, v);
+    }
   }
+}
 
-  /*
-  auto path = aug_.match(fmt::format("{}/iface[ . = 'bridge' ]", ifx_path));
-  if(path.empty()) throw runtime_error{"could not find bridge interface"};
-  return path[0];
-  */
+vector<string> Dcc::vlanMembers(size_t vid, bool doLoad)
+{
+  if(doLoad) { refresh(); }
+  return state_.vlanMembers(vid);
 }
 
-string Dcc::ifxPath(string ifx)
+VlanSet Dcc::parseVlist(const string & s)
 {
-  auto path = aug_.match(fmt::format("{}/iface[ . = '{}' ]", ifx_path, ifx));
-  if(path.empty()) throw runtime_error{"could not find interface " + ifx};
-  return path[0];
+  return VlanSet::parse(s);
 }
 
-string Dcc::emitVlist(vector<size_t> vs)
+optional<string> Dcc::bridgePath()
 {
-  string value;
-  for(auto x : vs)
-  {
-    value += to_string(x) + " ";
-  }
+  return findIfx("bridge");
+}
 
-  //augeas wont save a value with a trailing space!
-  value = value.substr(0, value.length() - 1);
+string Dcc::ifxPath(string ifx)
+{
+  auto path = findIfx(ifx);
+  if(!path) throw runtime_error{"could not find interface " + ifx};
+  return *path;
+}
 
-  return value;
+/*
+ * The tree paths of the ifaces are indexed as state_ is rebuilt after each
+ * load. Edits only ever change the settings under an iface, never add,
+ * remove or reorder them, so the index holds until the next load. 
+ */
+optional<string> Dcc::findIfx(const string & ifx)
+{
+  auto i = paths_.find(ifx);
+  if(i == paths_.end()) return optional<string>{};
+  return make_optional(i->second);
 }
 
-void Dcc::removeAccessPort(string ifx)
+//augeas wont save a value with a trailing space, str() never writes one
+string Dcc::emitVlist(const VlanSet & vs)
 {
-  aug_.clear(ifxPath(ifx), "bridge-access");
-  aug_.save();
+  return vs.str();
 }
 
 void Dcc::setBridgeAccess(string ifx, size_t vlan)
 {
   auto path = ifxPath(ifx);
+  touch(ifx);
   aug_.set(path, "bridge-access", to_string(vlan));
   aug_.set(path, "bridge-allow-untagged", "yes");
+  state_.setAccess(ifx, vlan);
+  state_.setTrunked(ifx, false);
 }
 
 void Dcc::addBridgeVid(string ifx, size_t vlan)
@@ -612,8 +1060,10 @@ void Dcc::addBridgeVid(string ifx, size_t vlan)
   if(!ifx_vids) return;
   
   auto vlist = parseVlist(*ifx_vids);
-  addVlan(vlan, vlist);
+  vlist.add(vlan);
+  touch(ifx);
   aug_.set(path, "bridge-vids", emitVlist(vlist));
+  state_.setVids(ifx, vlist);
 }
 
 void Dcc::removeBridgeAccess(string ifx, size_t vlan)
@@ -621,7 +1071,12 @@ void Dcc::removeBridgeAccess(string ifx, size_t vlan)
   auto path = ifxPath(ifx);
   auto ifx_access = aug_.get(path+"/bridge-access");
   if(!ifx_access) return;
-  if(stoul(*ifx_access) == vlan) aug_.clear(path, "bridge-access");
+  if(stoul(*ifx_access) == vlan) 
+  {
+    touch(ifx);
+    aug_.clear(path, "bridge-access");
+    state_.setAccess(ifx, optional<size_t>{});
+  }
 }
 
 void Dcc::removeBridgeVid(string ifx, size_t vlan)
@@ -631,11 +1086,301 @@ void Dcc::removeBridgeVid(string ifx, size_t vlan)
   if(!ifx_vids) return;
   
   auto vlist = parseVlist(*ifx_vids);
-  removeVlan(vlan, vlist);
+  vlist.remove(vlan);
+  touch(ifx);
   if(vlist.empty()) 
     aug_.clear(path, "bridge-vids");
   else 
     aug_.set(path, "bridge-vids", emitVlist(vlist));
+  state_.setVids(ifx, vlist);
+}
+
+void Dcc::touch(const string & ifx)
+{
+  touched_.insert(ifx);
+  if(before_.find(ifx) != before_.end()) return;
+  auto i = state_.ports.find(ifx);
+  before_[ifx] = i != state_.ports.end() ? i->second : PortState{};
+}
+
+void Dcc::rollback()
+{
+  touched_.clear();
+  before_.clear();
+  aug_.reload();
+  rebuild();
+}
+
+Dcc::Changes Dcc::commit()
+{
+  aug_.save();
+
+  //the change is on disk, let readers see it while the kernel catches up
+  publish();
+
+  Changes cs;
+  for(const auto & t : before_)
+  {
+    const PortState & was = t.second;
+    const PortState & is = state_.ports[t.first];
+
+    if(was.trunked == is.trunked && was.access == is.access && 
+       was.vids == is.vids) continue;
+
+    cs[t.first] = {was, is};
+  }
+  before_.clear();
+
+  return cs;
+}
+
+/*
+ * Group commit. Every mutation goes through here with its port locks held.
+ * The first to arrive becomes the leader, waits for others to join and then
+ * runs the edits of everyone that queued up behind it against the tree in 
+ * one go, followed by a single save and a single apply. Each caller gets the
+ * part of the apply that concerns the ports it touched. Mutations of the
+ * same port never end up in one group since the port locks serialize them.
+ *
+ * The leader only waits, for no longer than the commit window, while there
+ * is someone to wait for: a request that holds port locks but has not 
+ * queued yet, or a group still committing, whose locks stand in the way of
+ * others. A caller holding every port lock never waits, nobody can join it.
+ *
+ * An edit that throws is reported to its own caller only. Whatever it did 
+ * to the tree before throwing must not go out with the rest of the group, 
+ * so rather than unpick it the tree is reloaded from disk, which holds the
+ * last commit, and the edits of the others are run again.
+ */
+ApplyResult Dcc::mutate(std::function<void()> edit)
+{
+  auto me = std::make_shared<Pending>();
+  me->edit = std::move(edit);
+
+  std::unique_lock<mutex> gl{groupMtx_};
+  queue_.push_back(me);
+
+  if(leading_)
+  {
+    groupCv_.notify_all();
+    groupCv_.wait(gl, [&]{ return me->done; });
+    if(me->error) std::rethrow_exception(me->error);
+    return me->result;
+  }
+
+  leading_ = true;
+  auto company = [this]
+  { 
+    return inflight_ > 0 || locks_.holders() > queue_.size(); 
+  };
+  auto until = chrono::steady_clock::now() + options.commitWindow;
+  while(company() && chrono::steady_clock::now() < until)
+    groupCv_.wait_for(gl, chrono::milliseconds{1});
+
+  //anything arriving from here on starts the next group
+  std::deque<shared_ptr<Pending>> group;
+  group.swap(queue_);
+  leading_ = false;
+  inflight_ += group.size();
+  gl.unlock();
+
+  ApplyResult r;
+  size_t matches{0};
+  try
+  {
+    Changes cs;
+    std::unique_lock<mutex> uplinks;
+    {
+      lock_guard<mutex> lk{treeMtx_};
+      try
+      {
+        matches = aug_.stats().matches;
+        refresh();
+        for(bool clean{false}; !clean; )
+        {
+          clean = true;
+          for(auto & p : group)
+          {
+            if(p->error) continue;
+            touched_.clear();
+            try { p->edit(); }
+            catch(...) 
+            { 
+              p->error = std::current_exception(); 
+              clean = false;
+            }
+            p->ports = touched_;
+          }
+          if(!clean) rollback();
+        }
+        touched_.clear();
+
+        //the uplinks change on behalf of the whole group
+        if(options.pruneUplinks && prune())
+        {
+          uplinks = std::unique_lock<mutex>{uplinkMtx_};
+          for(auto & p : group) 
+            p->ports.insert(touched_.begin(), touched_.end());
+          touched_.clear();
+        }
+        cs = commit();
+        matches = aug_.stats().matches - matches;
+      }
+      catch(...)
+      {
+        rollback();
+        throw;
+      }
+    }
+    r = apply(cs);
+    r.augMatches = matches;
+  }
+  catch(...)
+  {
+    //the group as a whole failed, every member hears about it
+    for(auto & p : group) 
+      if(!p->error) p->error = std::current_exception();
+  }
+
+  mutations_ += group.size();
+  ++commits_;
+  if(group.size() > 1) 
+    LOG(INFO) << "group commit of " << group.size() << " mutations";
+
+  auto mine = [](const vector<string> & ifxs, const std::set<string> & ports)
+  {
+    vector<string> v;
+    for(const string & ifx : ifxs) if(ports.count(ifx)) v.push_back(ifx);
+    return v;
+  };
+
+  gl.lock();
+  for(auto & p : group)
+  {
+    p->result = r;
+    p->result.netlink = mine(r.netlink, p->ports);
+    p->result.cycled = mine(r.cycled, p->ports);
+    p->result.batched = group.size();
+    p->done = true;
+  }
+  inflight_ -= group.size();
+  gl.unlock();
+  groupCv_.notify_all();
+
+  if(me->error) std::rethrow_exception(me->error);
+  return me->result;
+}
+
+/*
+ * Push the changes to the touched ports into the kernel. The vlan deltas are
+ * programmed directly over netlink. Ports whose tagging changed, or that
+ * fall back to inheriting the bridge vlans, are left to ifup since the
+ * resulting kernel state depends on ifupdown2 policy.
+ *
+ * This runs under the port locks of the request only, so requests on other
+ * ports program the switch at the same time. Bridge vlans are only ever 
+ * taken away by requests that hold every port, so the additions of 
+ * concurrent requests can land in any order.
+ */
+ApplyResult Dcc::apply(const Changes & cs)
+{
+  try { return activate(cs); }
+  catch(std::exception &e) 
+  { 
+    LOG(ERROR) << "apply failed: " << e.what(); 
+  }
+  catch(...) { LOG(ERROR) << "apply failed: unknown error"; }
+
+  //the change is saved and published already, only activating it failed
+  ApplyResult r;
+  r.ok = false;
+  return r;
+}
+
+ApplyResult Dcc::activate(const Changes & cs)
+{
+  auto start = chrono::steady_clock::now();
+  ApplyResult r;
+  if(!options.activate) return r;
+
+  using BV = NetLink::BridgeVlan;
+  vector<BV> add, del;
+  std::set<string> cycle;
+
+
+  for(const auto & c : cs)
+  {
+    const string & ifx = c.first;
+    const PortState & was = c.second.first;
+    const PortState & is = c.second.second;
+
+    bool explicitVlans =
+      (was.access || !was.vids.empty()) && (is.access || !is.vids.empty());
+
+    if(!options.netlinkApply || was.trunked != is.trunked || 
+       (ifx != "bridge" && !explicitVlans))
+    {
+      cycle.insert(ifx);
+      continue;
+    }
+
+    if(was.access != is.access)
+    {
+      if(was.access) del.push_back(BV{ifx, (uint16_t)*was.access, true});
+      if(is.access) add.push_back(BV{ifx, (uint16_t)*is.access, true});
+    }
+    (was.vids - is.vids).each([&](size_t v)
+    { 
+      del.push_back(BV{ifx, (uint16_t)v, false}); 
+    });
+    (is.vids - was.vids).each([&](size_t v)
+    { 
+      add.push_back(BV{ifx, (uint16_t)v, false}); 
+    });
+  }
+
+  std::set<string> programmed;
+  for(const auto & v : add) programmed.insert(v.ifx);
+  for(const auto & v : del) programmed.insert(v.ifx);
+
+  for(const string & ifx : NetLink::setBridgeVlans(add, del)) 
+  {
+    programmed.erase(ifx);
+    cycle.insert(ifx);
+  }
+  r.netlink.assign(programmed.begin(), programmed.end());
+  r.cycled.assign(cycle.begin(), cycle.end());
+
+  vector<string> strategy;
+  if(!programmed.empty()) strategy.push_back("netlink");
+  if(!cycle.empty())
+  {
+    lock_guard<mutex> lk{ifupdownMtx_};
+    switch(options.fallback)
+    {
+      case Fallback::Ifup: 
+        strategy.push_back("ifup");
+        r.ok = ifup(r.cycled);
+        break;
+      case Fallback::Ifreload: 
+        strategy.push_back("ifreload");
+        r.ok = ifreload();
+        break;
+    }
+  }
+  if(!strategy.empty())
+  {
+    r.strategy = strategy[0];
+    for(size_t i=1; i<strategy.size(); ++i) r.strategy += "+" + strategy[i];
+  }
+
+  r.ms = 
+    chrono::duration<double, milli>(chrono::steady_clock::now() - start)
+    .count();
+
+  LOG(INFO) << "apply: " << r.strategy << " " << r.ms << " ms";
+
+  return r;
 }
 
 bool Dcc::isTrunk(string ifx)
@@ -653,6 +1398,56 @@ bool Dcc::isTrunk(string ifx)
   }
 }
 
+Json PortStats::json() const
+{
+  Json j;
+  j["name"] = name;
+  j["rx"] = {
+    {"bytes", rxBytes}, {"packets", rxPackets}, 
+    {"errors", rxErrors}, {"dropped", rxDropped}
+  };
+  j["tx"] = {
+    {"bytes", txBytes}, {"packets", txPackets}, 
+    {"errors", txErrors}, {"dropped", txDropped}
+  };
+
+  if(interval > 0)
+  {
+    j["interval"] = interval;
+    j["rate"] = {
+      {"rx_bps", rxBytes * 8 / interval}, 
+      {"tx_bps", txBytes * 8 / interval},
+      {"rx_pps", rxPackets / interval}, 
+      {"tx_pps", txPackets / interval}
+    };
+  }
+  return j;
+}
+
+Json Metrics::json() const
+{
+  Json j;
+  j["mutations"] = mutations;
+  j["commits"] = commits;
+  j["augeas"] = {
+    {"matches", augMatches}, {"loads", augLoads}, {"saves", augSaves}
+  };
+  return j;
+}
+
+Json ApplyResult::json() const
+{
+  Json j;
+  j["strategy"] = strategy;
+  j["ms"] = ms;
+  j["ok"] = ok;
+  j["netlink"] = netlink;
+  j["cycled"] = cycled;
+  j["batched"] = batched;
+  j["aug_matches"] = augMatches;
+  return j;
+}
+
   ostream & deter::operator<<(ostream & o, const PortControlCommand & c)
   {
     using C = PortControlCommand;
@@ -704,6 +1499,8 @@ Json PortState::json() const
 {
   Json j;
   j["trunked"] = trunked;
+  if(access) j["access"] = *access;
+  j["vids"] = vids.ids();
   return j;
 }
 
@@ -711,6 +1508,8 @@ PortState PortState::fromJson(Json j)
 {
   PortState p;
   p.trunked = j.at("trunked");
+  if(j.count("access")) p.access = j.at("access").get<size_t>();
+  if(j.count("vids")) p.vids = VlanSet{j.at("vids").get<vector<size_t>>()};
   return p;
 }
 
@@ -736,6 +1535,79 @@ SwitchState SwitchState::fromJson(Json j)
   {
     s.ports[it.key()] = PortState::fromJson(it.value());
   }
+  s.reindex();
 
   return s;
 }
+
+vector<size_t> SwitchState::vlans() const
+{
+  auto b = ports.find("bridge");
+  if(b == ports.end()) return vector<size_t>{};
+  return b->second.vids.ids();
+}
+
+bool SwitchState::hasVlan(size_t vid) const
+{
+  auto b = ports.find("bridge");
+  if(b == ports.end()) return false;
+  return b->second.vids.test(vid);
+}
+
+vector<string> SwitchState::vlanMembers(size_t vid) const
+{
+  auto i = members.find(vid);
+  if(i == members.end()) return vector<string>{};
+  return vector<string>(i->second.begin(), i->second.end());
+}
+
+void SwitchState::setTrunked(const string & ifx, bool trunked)
+{
+  ports[ifx].trunked = trunked;
+}
+
+void SwitchState::setAccess(const string & ifx, optional<size_t> vid)
+{
+  index(ifx, false);
+  ports[ifx].access = vid;
+  index(ifx, true);
+}
+
+void SwitchState::setVids(const string & ifx, const VlanSet & vids)
+{
+  index(ifx, false);
+  ports[ifx].vids = vids;
+  index(ifx, true);
+}
+
+void SwitchState::reindex()
+{
+  members.clear();
+  for(const auto & p : ports) index(p.first, true);
+}
+
+//add or remove ifx from the member sets of the vlans it carries, the bridge
+//carries every vlan and is not a member of anything
+void SwitchState::index(const string & ifx, bool add)
+{
+  if(ifx == "bridge") return;
+
+  auto i = ports.find(ifx);
+  if(i == ports.end()) return;
+  const PortState & p = i->second;
+
+  auto update = [this, &ifx, add](size_t vid)
+  {
+    if(add) members[vid].insert(ifx);
+    else
+    {
+      auto m = members.find(vid);
+      if(m == members.end()) return;
+      m->second.erase(ifx);
+      if(m->second.empty()) members.erase(m);
+    }
+  };
+
+  p.vids.each(update);
+  if(p.access) update(*p.access);
+}
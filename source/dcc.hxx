@@ -2,11 +2,23 @@
 
 #include <vector>
 #include <set>
+#include <map>
 #include <string>
 #include <experimental/optional>
 #include <unordered_map>
+#include <chrono>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <exception>
+#include <memory>
+#include <atomic>
+#include <shared_mutex>
+#include <regex>
+#include <thread>
 #include "augeas.hxx"
+#include "vlanset.hxx"
 #include "json.hxx"
 
 namespace deter
@@ -16,6 +28,7 @@ namespace deter
   class Dcc;
   struct VlanInfo;
   struct Interface;
+  struct ApplyResult;
 
   enum class PortControlCommand : int {
     Enable,
@@ -36,56 +49,251 @@ namespace deter
 
   struct PortState
   {
-    bool trunked;
+    bool trunked{false};
+    std::experimental::optional<size_t> access;
+
+    //bridge-vids
+    VlanSet vids;
 
     Json json() const;
     static PortState fromJson(Json j);
   };
   
+  /*
+   * In memory model of the bridge configuration, this is built from the
+   * augeas tree when it is (re)loaded and kept current by the Dcc mutators so
+   * read only queries never have to go to augeas
+   */
   struct SwitchState
   {
+    //every iface in /etc/network/interfaces, including the bridge
     std::unordered_map<std::string, PortState> ports;
 
+    //vlan id -> ports that carry it either as access or trunk vlan
+    std::unordered_map<size_t, std::set<std::string>> members;
+
+    std::vector<size_t> vlans() const;
+    std::vector<std::string> vlanMembers(size_t vid) const;
+    bool hasVlan(size_t vid) const;
+
+    void setTrunked(const std::string & ifx, bool trunked);
+    void setAccess(const std::string & ifx, 
+        std::experimental::optional<size_t> vid);
+    void setVids(const std::string & ifx, const VlanSet & vids);
+    void reindex();
+
     void save();
     void load();
     Json json() const;
     static SwitchState fromJson(Json j);
+
+    private:
+      void index(const std::string & ifx, bool add);
+  };
+
+  struct PortStats
+  {
+    std::string name;
+
+    uint64_t
+      rxBytes{0}, txBytes{0},
+      rxPackets{0}, txPackets{0},
+      rxErrors{0}, txErrors{0},
+      rxDropped{0}, txDropped{0};
+
+    //seconds covered by the counters in delta mode, 0 for absolute counters
+    double interval{0};
+
+    Json json() const;
+  };
+
+  //running totals since startup
+  struct Metrics
+  {
+    size_t mutations{0}, commits{0};
+    size_t augMatches{0}, augLoads{0}, augSaves{0};
+
+    Json json() const;
+  };
+
+  //how a mutation was activated on the switch
+  struct ApplyResult
+  {
+    //none, netlink, ifup, ifreload or netlink+ifup/ifreload
+    std::string strategy{"none"};
+    double ms{0};
+    bool ok{true};
+
+    //ports programmed over netlink and ports handed to ifupdown
+    std::vector<std::string> netlink, cycled;
+
+    //number of requests saved and applied together with this one
+    size_t batched{1};
+
+    //augeas lookups made while editing and saving for this request
+    size_t augMatches{0};
+
+    Json json() const;
+  };
+
+  //one step of a batch, the fields used are those of the single call of the
+  //same name
+  struct BatchOp
+  {
+    enum class Kind 
+    { 
+      SetPortVlan,
+      DelPortVlan,
+      SetVlansOnTrunk,
+      EnablePortTrunking,
+      DisablePortTrunking,
+      RemoveVlans,
+      RemovePortsFromVlan,
+      RemoveSomePortsFromVlan
+    };
+
+    Kind kind;
+    std::vector<std::string> ports;
+    std::vector<size_t> vlans;
+    bool allow{true};
+  };
+
+  /*
+   * Write locks per interface. A request locks the ports it edits in name 
+   * order so overlapping multi port requests can't deadlock, requests that
+   * edit whatever ports carry a vlan take the whole table.
+   */
+  class PortLocks
+  {
+    public:
+      struct Guard
+      {
+        //counts the guard in holders() until after the locks are let go
+        std::shared_ptr<void> held;
+
+        std::shared_lock<std::shared_timed_mutex> some;
+        std::unique_lock<std::shared_timed_mutex> all;
+        std::vector<std::unique_lock<std::mutex>> ports;
+      };
+
+      Guard lock(std::vector<std::string> ifxs);
+      Guard lockAll();
+
+      //requests holding or waiting for port locks right now
+      size_t holders() const { return holders_; }
+
+    private:
+      std::shared_ptr<void> hold();
+
+      std::atomic<size_t> holders_{0};
+      std::shared_timed_mutex all_;
+      std::mutex mtx_;
+      std::unordered_map<std::string, std::unique_ptr<std::mutex>> ports_;
   };
 
   class Dcc
   {
     public:
+      //augRoot is where the interfaces files are read from, see Augeas
+      explicit Dcc(std::string augRoot = "");
+      ~Dcc();
+
+      //load the tree, move the stanzas out with fragments, and watch the 
+      //interfaces files for changes made by others. Call once the options 
+      //are set
+      void start();
+
+      enum class Fallback { Ifup, Ifreload };
+
+      struct Options
+      {
+        //push changes into the kernel at all, without it they are only 
+        //saved, which is what the tests run with
+        bool activate{true};
+
+        //program bridge vlans over netlink rather than running ifup
+        bool netlinkApply{true};
+
+        //how to activate the ports netlink can't handle, either a single 
+        //`ifup <ports...>` or `ifreload -a`
+        Fallback fallback{Fallback::Ifup};
+
+        //how often the watcher looks for changes others made on disk
+        std::chrono::milliseconds reloadInterval{1000};
+
+        //how long the first of a burst of mutations waits for others to join
+        //it in a single save and apply
+        std::chrono::milliseconds commitWindow{10};
+
+        //keep each port and the bridge in its own interfaces.d/<name>.intf
+        //so a change rewrites only the files of the ports it touches, the
+        //stanzas are moved there by start()
+        bool fragments{false};
+
+        //keep the vids of the uplinks equal to the union of the vlans the
+        //downlinks are in plus uplinkKeep, on every commit
+        bool pruneUplinks{false};
+        std::regex uplinks{"^swp(9|1[0-9]|2[0-4])$"};
+        std::regex downlinks{"^swp[1-9][0-9]?s[0-3]$"};
+        VlanSet uplinkKeep{1};
+      };
+      Options options;
+
       std::vector<VlanInfo> listVlans();
 
       std::vector<std::pair<size_t, std::experimental::optional<size_t>>> 
       findVlans(std::vector<size_t> ids = {});
 
       bool vlanHasPorts(size_t vlan_id);
+
+      //changes whenever the vlan state readers see does, for caching what is
+      //derived from it
+      uint64_t version();
+
+      Metrics metrics();
       
       std::vector<Interface> getInterfaces();
 
-      void disablePortTrunking(std::string ifx, bool finalize = true);
-      bool enablePortTrunking(std::string ifx, size_t vlan_id, bool eq_trunk);
-      void setVlansOnTrunk(std::string ifx, std::vector<size_t> vlans,
+      //hardware counters of the given ports (all when empty), with delta set
+      //the change and rate since the previous sample of each port
+      std::vector<PortStats> portStats(std::vector<std::string> ifxs = {},
+          bool delta = false);
+
+      //both empty when ifx is not a port
+      std::experimental::optional<ApplyResult> 
+      disablePortTrunking(std::string ifx);
+      std::experimental::optional<ApplyResult> 
+      enablePortTrunking(std::string ifx, size_t vlan_id, bool eq_trunk);
+      ApplyResult setVlansOnTrunk(std::string ifx, std::vector<size_t> vlans,
           bool allow);
-      void removeVlans(std::vector<size_t> vlans);
-      void delPortVlan(std::vector<std::string> ifxs, size_t vlan);
-      void setPortVlan(std::vector<std::string> ifx, size_t vlan);
-      void removePortsFromVlan(std::vector<size_t> vlans, bool load_save = true);
-      void removeSomePortsFromVlan(size_t vlan, std::vector<std::string> ifxs);
-      void portControl(PortControlCommand cmd, std::vector<std::string> ifxs);
+      ApplyResult removeVlans(std::vector<size_t> vlans);
+      ApplyResult delPortVlan(std::vector<std::string> ifxs, size_t vlan);
+      ApplyResult setPortVlan(std::vector<std::string> ifx, size_t vlan);
+      ApplyResult removePortsFromVlan(std::vector<size_t> vlans);
+      ApplyResult removeSomePortsFromVlan(size_t vlan, 
+          std::vector<std::string> ifxs);
+
+      //run the operations in order as a single change, either all of them
+      //take effect or none do
+      ApplyResult batch(const std::vector<BatchOp> & ops);
+
+      //bring the uplinks in line with the downlinks now rather than at the
+      //next change, for when pruning is first turned on
+      ApplyResult syncUplinks();
+
+      //returns the ports that failed and why
+      std::map<std::string, std::string>
+      portControl(PortControlCommand cmd, std::vector<std::string> ifxs);
 
     private:
       std::vector<std::string> vlanMembers(size_t vid, bool doLoad = true);
-      std::string emitVlist(std::vector<size_t> vids);
-      std::vector<size_t> parseVlist(std::string);
-      void addVlan(size_t v, std::vector<size_t> & vs);
-      void removeVlan(size_t v, std::vector<size_t> & vs);
+      std::string emitVlist(const VlanSet & vids);
+      VlanSet parseVlist(const std::string & s);
       std::experimental::optional<std::string> bridgePath();
       std::string ifxPath(std::string ifx);
+      std::experimental::optional<std::string> findIfx(const std::string & ifx);
       //void setAccessPort(std::string ifx, size_t vlan);
-      void removeAccessPort(std::string ifx);
-      void setIfxVids(std::string ifx, std::vector<size_t> vlans, bool allow);
+      void setIfxVids(std::string ifx, const VlanSet & vlans, bool allow);
 
       void setBridgeAccess(std::string ifx, size_t vlan);
       void addBridgeVid(std::string ifx, size_t vlan);
@@ -93,17 +301,134 @@ namespace deter
       void removeBridgeVid(std::string ifx, size_t vlan);
 
       bool isTrunk(std::string ifx);
-      void updateActiveInterfaces();
+
+      //ifx is in the published state, logs when it isn't
+      bool hasPort(const std::string & ifx);
+
+      //reload the augeas tree if it changed on disk and rebuild state_ from it
+      void refresh();
+
+      //rebuild state_ from the augeas tree
+      void rebuild();
+
+      //move the managed stanzas out of the main interfaces file, true if 
+      //any were moved
+      bool fragment();
+      static std::string ifaces(std::string pred = "");
+
+      //apply one operation to the tree and state_, check throws if it can't,
+      //what prefixes the reason
+      bool edit(const BatchOp & op);
+      static void check(const std::string & what, const BatchOp & op,
+          const SwitchState & state);
+
+      //the state readers work from, never blocks on a writer
+      std::shared_ptr<const SwitchState> snapshot();
+
+      //make state_ what readers see
+      void publish();
+
+      //drop the given vlans from every port that has them
+      void unlinkVlans(const std::vector<size_t> & vlans);
+
+      //set the uplink vids from the downlinks, true if any of them changed
+      bool prune();
+
+      //record the state of a port before a mutator changes it
+      void touch(const std::string & ifx);
+
+      //ports changed by a request, what they were and what they are now
+      using Changes = 
+        std::unordered_map<std::string, std::pair<PortState, PortState>>;
+
+      //throw away the edits since the last commit, going back to the tree
+      //and state_ on disk
+      void rollback();
+
+      //save the tree, publish the new state and hand back what changed
+      Changes commit();
+
+      //activate the changes on the switch, runs without the tree lock. The
+      //change is saved by then, a failure is reported in the result
+      ApplyResult apply(const Changes & cs);
+      ApplyResult activate(const Changes & cs);
+
+      //run edit against the tree, grouped with whatever other mutations 
+      //arrive within options.commitWindow, see the comment in dcc.cxx
+      ApplyResult mutate(std::function<void()> edit);
+
+      //ports touched by the current mutation and their state before it
+      std::unordered_map<std::string, PortState> before_;
+
+      //ports touched by the edit currently running inside a group
+      std::set<std::string> touched_;
+
+      //a mutation waiting for, or being carried by, a group commit
+      struct Pending
+      {
+        std::function<void()> edit;
+        std::exception_ptr error;
+        std::set<std::string> ports;
+        ApplyResult result;
+        bool done{false};
+      };
+      std::deque<std::shared_ptr<Pending>> queue_;
+      bool leading_{false};
+
+      //members of groups whose leader has taken them off queue_ and not yet
+      //handed back their results
+      size_t inflight_{0};
+      std::mutex groupMtx_;
+      std::condition_variable groupCv_;
+
+      //see start()
+      std::thread watcher_;
+      std::mutex watchMtx_;
+      std::condition_variable watchCv_;
+      bool stopping_{false};
+      std::once_flag loaded_;
       
-      //interfaces that have an entry in /etc/network/interfaces
-      std::set<std::string> activeIfxs_;
       Augeas aug_;
 
+      //writers hold the locks of the ports they edit for the whole request
+      //and treeMtx_ only while editing the augeas tree and state_, which is
+      //where the shared bridge-vids are changed. Readers only ever see 
+      //snapshot_ which writers replace whole
+      PortLocks locks_;
       SwitchState state_;
+      std::shared_ptr<const SwitchState> snapshot_{
+        std::make_shared<const SwitchState>()};
+      std::atomic<uint64_t> version_{0};
+
+      //iface name -> augeas path, rebuilt with state_
+      std::unordered_map<std::string, std::string> paths_;
+
+      std::atomic<size_t> mutations_{0}, commits_{0};
+      std::mutex treeMtx_;
+
+      //held from a commit that changed the uplinks until its apply is done,
+      //taken before treeMtx_ is let go so the uplink deltas reach the kernel
+      //in commit order
+      std::mutex uplinkMtx_;
+
+      //ifupdown2 refuses to run while another instance is
+      std::mutex ifupdownMtx_;
+
+      //last counter sample of each port, what delta mode is measured against
+      struct StatsSample
+      {
+        std::chrono::steady_clock::time_point at;
+        PortStats stats;
+      };
+      std::unordered_map<std::string, StatsSample> lastStats_;
+      std::mutex statsMtx_;
+
       static const std::string 
         bridge_access,
         bridge_vids,
-        ifx_path;
+        ifx_path,
+        frag_path,
+        frag_glob;
   };
 
   struct VlanInfo
@@ -1,17 +1,59 @@
 #include "catch.hpp"
 #include "dcc.hxx"
 #include "pipes.hxx"
-#include <httpxx/json.hxx>
+#include "augeas.hxx"
+#include "netlink.hxx"
+#include "jobs.hxx"
+#include <fmt/format.h>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include <regex>
+#include <cstdlib>
+#include <map>
+#include <glob.h>
+#include <sys/stat.h>
 
 using namespace deter;
 using Json = nlohmann::json;
 using std::to_string;
+using std::string;
+using std::vector;
+using std::pair;
+namespace chrono = std::chrono;
+
+//where this file is, the test roots live next to it
+static string here()
+{
+  string src = string(__FILE__);
+  return src.substr(0, src.rfind('/'));
+}
+
+//an augeas root under /tmp holding the given interfaces file
+static string scratchRoot(const string & name, const string & interfaces)
+{
+  string root = "/tmp/dcc_test_" + name;
+  mkdir(root.c_str(), 0755);
+  mkdir((root+"/etc").c_str(), 0755);
+  mkdir((root+"/etc/network").c_str(), 0755);
+  std::ofstream ofs{root+"/etc/network/interfaces"};
+  ofs << interfaces;
+  return root;
+}
+
+static string slurp(const string & root)
+{
+  std::ifstream ifs{root + "/etc/network/interfaces"};
+  std::stringstream buf;
+  buf << ifs.rdbuf();
+  return buf.str();
+}
 
-/*
 TEST_CASE("list vlans", "[dcc]")
 {
-  Dcc dcc;
+  Dcc dcc{here() + "/test/augroot"};
   auto vlans = dcc.listVlans();
   REQUIRE( vlans.size() == 4 );
   REQUIRE( vlans[0].deterId == 100 );
@@ -23,19 +65,326 @@ TEST_CASE("list vlans", "[dcc]")
 
 TEST_CASE("find vlans", "[dcc]")
 {
-  Dcc dcc;
+  Dcc dcc{here() + "/test/augroot"};
   auto vmap = dcc.findVlans();
   REQUIRE( vmap.size() == 4 );
-  //REQUIRE( vmap.at(100) == 100 );
+  REQUIRE( vmap[0].first == 100 );
+  REQUIRE( *vmap[0].second == 100 );
+
+  auto some = dcc.findVlans({200, 500});
+  REQUIRE( some.size() == 2 );
+  REQUIRE( some[0].second );
+  REQUIRE( !some[1].second );
 }
 
 TEST_CASE("vlan has ports", "[dcc]")
 {
-  Dcc dcc;
+  Dcc dcc{here() + "/test/augroot"};
   REQUIRE( dcc.vlanHasPorts(100) == true );
   REQUIRE( dcc.vlanHasPorts(700) == false );
 }
-*/
+
+TEST_CASE("exact vlan membership", "[dcc]")
+{
+  //10 is a substring of both 100 and 210 but nobody is in it
+  auto root = scratchRoot("membership",
+    "auto bridge\n"
+    "iface bridge\n"
+    "  bridge-vlan-aware yes\n"
+    "  bridge-ports swp1 swp2 swp3\n"
+    "  bridge-vids 10 100 210\n"
+    "\n"
+    "iface swp1\n"
+    "  bridge-access 100\n"
+    "\n"
+    "iface swp2\n"
+    "  bridge-vids 210\n"
+    "\n"
+    "iface swp3\n"
+    "  bridge-vids 100 210\n");
+
+  Dcc dcc{root};
+  REQUIRE( dcc.vlanHasPorts(10) == false );
+  REQUIRE( dcc.vlanHasPorts(100) == true );
+  REQUIRE( dcc.vlanHasPorts(210) == true );
+
+  auto vlans = dcc.listVlans();
+  REQUIRE( vlans.size() == 3 );
+  REQUIRE( vlans[0].deterId == 10 );
+  REQUIRE( vlans[0].members.empty() );
+  REQUIRE( vlans[1].deterId == 100 );
+  REQUIRE( vlans[1].members == (vector<string>{"swp1", "swp3"}) );
+  REQUIRE( vlans[2].deterId == 210 );
+  REQUIRE( vlans[2].members == (vector<string>{"swp2", "swp3"}) );
+}
+
+TEST_CASE("readers are served from the snapshot", "[dcc]")
+{
+  string config =
+    "auto bridge\n"
+    "iface bridge\n"
+    "  bridge-vlan-aware yes\n"
+    "  bridge-ports swp1 swp2 swp3\n"
+    "  bridge-vids 100\n"
+    "\n"
+    "iface swp1\n"
+    "  bridge-access 100\n"
+    "\n"
+    "iface swp2\n"
+    "  bridge-access 1oo\n"
+    "\n"
+    "iface swp3\n"
+    "  bridge-vids 100-\n";
+  auto root = scratchRoot("readers", config);
+
+  //values that don't parse are left out rather than failing every reader
+  Dcc dcc{root};
+  dcc.options.reloadInterval = chrono::milliseconds{10};
+  auto vlans = dcc.listVlans();
+  REQUIRE( vlans.size() == 1 );
+  REQUIRE( vlans[0].members == vector<string>{"swp1"} );
+
+  //a change on disk does not reach readers by itself
+  config = std::regex_replace(config, std::regex{"1oo"}, "200");
+  config = std::regex_replace(config, std::regex{"vids 100\n"}, 
+      "vids 100 200\n");
+  std::ofstream{root + "/etc/network/interfaces"} << config;
+  REQUIRE( dcc.listVlans().size() == 1 );
+
+  //but the watcher picks it up
+  dcc.start();
+  for(size_t i=0; i<200 && dcc.listVlans().size() == 1; ++i)
+    std::this_thread::sleep_for(chrono::milliseconds{10});
+  REQUIRE( dcc.vlanHasPorts(200) );
+}
+
+TEST_CASE("failed mutations are not saved", "[dcc]")
+{
+  //swp1 passes the checks but its access vlan does not parse, so enabling
+  //trunking on it fails half way through the edit
+  auto root = scratchRoot("mutate",
+    "auto bridge\n"
+    "iface bridge\n"
+    "  bridge-vlan-aware yes\n"
+    "  bridge-ports swp1 swp2\n"
+    "  bridge-vids 100\n"
+    "\n"
+    "iface swp1\n"
+    "  bridge-allow-untagged yes\n"
+    "  bridge-access 12x\n"
+    "\n"
+    "iface swp2\n"
+    "  bridge-allow-untagged yes\n"
+    "  bridge-access 100\n");
+
+  Dcc dcc{root};
+  dcc.options.activate = false;
+  dcc.options.commitWindow = chrono::milliseconds{200};
+
+  REQUIRE_THROWS( dcc.setPortVlan({"swp2"}, 5000) );
+  REQUIRE_THROWS( dcc.setPortVlan({"swp3"}, 200) );
+  REQUIRE_THROWS( dcc.removeVlans({0}) );
+  REQUIRE( slurp(root).find("5000") == string::npos );
+
+  REQUIRE( !dcc.enablePortTrunking("swp3", 200, false) );
+  REQUIRE( !dcc.disablePortTrunking("swp3") );
+
+  //the two share a group commit, only the one that worked is saved
+  bool failed{false};
+  std::thread t{[&]
+  { 
+    try { dcc.enablePortTrunking("swp1", 200, false); }
+    catch(std::exception &) { failed = true; }
+  }};
+  dcc.setPortVlan({"swp2"}, 300);
+  t.join();
+  REQUIRE( failed );
+
+  string config = slurp(root);
+  REQUIRE( config.find("bridge-allow-untagged no") == string::npos );
+  REQUIRE( config.find("bridge-access 300") != string::npos );
+
+  Dcc fresh{root};
+  REQUIRE( fresh.vlanHasPorts(300) );
+  REQUIRE( !fresh.vlanHasPorts(200) );
+  REQUIRE( dcc.listVlans().size() == 2 );
+
+  //nobody else holds a port, so there is no one to wait the window out for
+  dcc.options.commitWindow = chrono::seconds{5};
+  auto t0 = chrono::steady_clock::now();
+  dcc.setPortVlan({"swp2"}, 100);
+  REQUIRE( chrono::steady_clock::now() - t0 < chrono::seconds{1} );
+}
+
+TEST_CASE("batches are all or nothing", "[dcc]")
+{
+  auto root = scratchRoot("batch",
+    "auto bridge\n"
+    "iface bridge\n"
+    "  bridge-vlan-aware yes\n"
+    "  bridge-ports swp1 swp2 swp3\n"
+    "  bridge-vids 100 200\n"
+    "\n"
+    "iface swp1\n"
+    "  bridge-allow-untagged yes\n"
+    "  bridge-access 100\n"
+    "\n"
+    "iface swp2\n"
+    "  bridge-allow-untagged no\n"
+    "  bridge-vids 100 200\n"
+    "\n"
+    "iface swp3\n"
+    "  bridge-allow-untagged yes\n"
+    "  bridge-access 7x\n");
+
+  Dcc dcc{root};
+  dcc.options.activate = false;
+
+  auto members = [&dcc]()
+  {
+    vector<pair<size_t, vector<string>>> v;
+    for(const auto & x : dcc.listVlans()) v.emplace_back(x.deterId, x.members);
+    return v;
+  };
+
+  string config = slurp(root);
+  auto before = members();
+
+  using K = BatchOp::Kind;
+
+  //the last op fails its check, nothing is applied
+  REQUIRE_THROWS( dcc.batch({
+    {K::SetPortVlan, {"swp1"}, {300}},
+    {K::RemoveVlans, {}, {200}},
+    {K::SetVlansOnTrunk, {"swp2"}, {400}},
+    {K::DelPortVlan, {"swp9"}, {100}}
+  }));
+  REQUIRE( slurp(root) == config );
+  REQUIRE( members() == before );
+
+  //the last op passes its check but fails half way through its edit
+  REQUIRE_THROWS( dcc.batch({
+    {K::SetPortVlan, {"swp1"}, {300}},
+    {K::RemoveVlans, {}, {200}},
+    {K::EnablePortTrunking, {"swp3"}, {500}}
+  }));
+  REQUIRE( slurp(root) == config );
+  REQUIRE( members() == before );
+
+  //and without the bad op it all goes through
+  dcc.batch({
+    {K::SetPortVlan, {"swp1"}, {300}},
+    {K::RemoveVlans, {}, {200}}
+  });
+  REQUIRE( members() == (vector<pair<size_t, vector<string>>>{
+    {100, {"swp2"}}, {300, {"swp1"}}}) );
+}
+
+TEST_CASE("moving stanzas to fragments", "[dcc]")
+{
+  //swp1 has two stanzas, neither of which can be told to be the one
+  auto root = scratchRoot("fragments",
+    "auto bridge\n"
+    "iface bridge\n"
+    "  bridge-vlan-aware yes\n"
+    "  bridge-ports swp1 swp2\n"
+    "  bridge-vids 100\n"
+    "\n"
+    "iface swp1\n"
+    "  bridge-access 100\n"
+    "\n"
+    "iface swp1\n"
+    "  bridge-access 200\n"
+    "\n"
+    "iface swp2\n"
+    "  bridge-access 100\n");
+  string frags = root + "/etc/network/interfaces.d";
+  std::system(("rm -rf " + frags).c_str());
+  mkdir(frags.c_str(), 0755);
+
+  Dcc dcc{root};
+  dcc.options.activate = false;
+  dcc.options.fragments = true;
+  dcc.start();
+
+  string config = slurp(root);
+  REQUIRE( config.find("iface swp2") == string::npos );
+  REQUIRE( config.find("iface swp1") != string::npos );
+  REQUIRE( std::ifstream{frags + "/swp2.intf"}.good() );
+  REQUIRE( !std::ifstream{frags + "/swp1.intf"}.good() );
+
+  //and the moved port is edited in its fragment
+  dcc.setPortVlan({"swp2"}, 300);
+  std::ifstream ifs{frags + "/swp2.intf"};
+  std::stringstream swp2;
+  swp2 << ifs.rdbuf();
+  REQUIRE( swp2.str().find("bridge-access 300") != string::npos );
+}
+
+TEST_CASE("uplink pruning", "[dcc]")
+{
+  //swp1s0 and swp1s1 are downlinks, swp9 an uplink and swp5 neither
+  auto root = scratchRoot("prune",
+    "auto bridge\n"
+    "iface bridge\n"
+    "  bridge-vlan-aware yes\n"
+    "  bridge-ports swp1s0 swp1s1 swp5 swp9\n"
+    "  bridge-vids 1\n"
+    "\n"
+    "iface swp1s0\n"
+    "  bridge-allow-untagged yes\n"
+    "  bridge-access 1\n"
+    "\n"
+    "iface swp1s1\n"
+    "  bridge-allow-untagged no\n"
+    "  bridge-vids 1\n"
+    "\n"
+    "iface swp5\n"
+    "  bridge-allow-untagged yes\n"
+    "  bridge-access 1\n"
+    "\n"
+    "iface swp9\n"
+    "  bridge-allow-untagged no\n"
+    "  bridge-vids 1 100 200 300\n");
+
+  Dcc dcc{root};
+  dcc.options.activate = false;
+  dcc.options.pruneUplinks = true;
+
+  auto uplink = [&dcc]()
+  {
+    vector<size_t> v;
+    for(const auto & x : dcc.listVlans())
+    {
+      for(const auto & m : x.members) if(m == "swp9") v.push_back(x.deterId);
+    }
+    return v;
+  };
+
+  dcc.syncUplinks();
+  REQUIRE( uplink() == vector<size_t>{1} );
+
+  dcc.setPortVlan({"swp1s0"}, 100);
+  REQUIRE( uplink() == (vector<size_t>{1, 100}) );
+
+  dcc.setPortVlan({"swp1s1"}, 200);
+  REQUIRE( uplink() == (vector<size_t>{1, 100, 200}) );
+
+  //not a downlink, the uplink does not follow it
+  dcc.setPortVlan({"swp5"}, 300);
+  REQUIRE( uplink() == (vector<size_t>{1, 100, 200}) );
+
+  dcc.delPortVlan({"swp1s0"}, 100);
+  REQUIRE( uplink() == (vector<size_t>{1, 200}) );
+
+  //nothing left to carry, the uplink keeps what it has rather than going
+  //without bridge-vids
+  dcc.options.uplinkKeep = {};
+  dcc.delPortVlan({"swp1s1"}, 1);
+  dcc.delPortVlan({"swp1s1"}, 200);
+  REQUIRE( uplink() == (vector<size_t>{200}) );
+  REQUIRE( slurp(root).find("bridge-vids 200") != string::npos );
+}
 
 TEST_CASE("list interfaces", "[dcc]")
 {
@@ -67,3 +416,410 @@ TEST_CASE("list interfaces", "[dcc]")
 
   for(const auto x : j) std::cout << x.dump(2) << std::endl;
 }
+
+TEST_CASE("outside changes to the interfaces files", "[augeas]")
+{
+  string root = scratchRoot("watch",
+      "auto lo\niface lo inet loopback\n\nsource /etc/ports/*.intf\n");
+  mkdir((root+"/etc/ports").c_str(), 0755);
+  auto write = [&](const string & file, const string & text)
+  {
+    std::ofstream ofs{root + file};
+    ofs << text;
+  };
+  write("/etc/ports/swp1.intf", "iface swp1\n");
+
+  Augeas aug{root};
+  aug.load();
+  REQUIRE( !aug.stale() );
+
+  //a sourced file outside /etc/network
+  write("/etc/ports/swp1.intf", "iface swp1\n  bridge-access 100\n");
+  REQUIRE( aug.stale() );
+  aug.load();
+  REQUIRE( !aug.stale() );
+
+  //files next to it that nothing sources
+  write("/etc/ports/README", "not interfaces\n");
+  REQUIRE( !aug.stale() );
+
+  //a change made before a save of ours is not lost by it
+  write("/etc/ports/swp1.intf", "iface swp1\n  bridge-access 200\n");
+  aug.save();
+  REQUIRE( aug.stale() );
+}
+
+TEST_CASE("jobs that throw anything fail", "[jobs]")
+{
+  Jobs jobs{1};
+  size_t ok = jobs.submit("ok", []{ return Json{{"result", "ok"}}; });
+  size_t odd = jobs.submit("odd", []() -> Json { throw 42; });
+  size_t bad = jobs.submit("bad", []() -> Json 
+  { 
+    throw std::runtime_error{"bad"}; 
+  });
+
+  auto finished = [&](size_t id)
+  {
+    auto s = jobs.get(id)->state;
+    return s == Job::State::Done || s == Job::State::Failed;
+  };
+  for(size_t i=0; i<200 && !finished(bad); ++i)
+    std::this_thread::sleep_for(chrono::milliseconds{10});
+
+  REQUIRE( jobs.get(ok)->state == Job::State::Done );
+  REQUIRE( jobs.get(odd)->state == Job::State::Failed );
+  REQUIRE( jobs.get(odd)->error == "unknown error" );
+  REQUIRE( jobs.get(bad)->state == Job::State::Failed );
+  REQUIRE( jobs.get(bad)->error == "bad" );
+}
+
+TEST_CASE("vlan set", "[vlanset]")
+{
+  auto vs = VlanSet::parse("100-103 7  200 201 4094");
+  REQUIRE( vs.size() == 8 );
+  REQUIRE( vs.test(102) );
+  REQUIRE( !vs.test(104) );
+  REQUIRE( vs.str() == "7 100-103 200 201 4094" );
+
+  vs.remove(101);
+  REQUIRE( vs.str() == "7 100 102 103 200 201 4094" );
+
+  VlanSet all = VlanSet::parse("1-4094");
+  REQUIRE( all.size() == 4094 );
+  REQUIRE( all.str() == "1-4094" );
+  REQUIRE( (all - VlanSet::parse("2-4094")).ids() == vector<size_t>{1} );
+  REQUIRE( (vs & VlanSet{7, 8}) == VlanSet{7} );
+  REQUIRE( (VlanSet{} | VlanSet{}).empty() );
+  REQUIRE( VlanSet::parse("").str() == "" );
+
+  REQUIRE_THROWS( VlanSet::parse("100-") );
+  REQUIRE_THROWS( VlanSet::parse("10a") );
+  REQUIRE_THROWS( VlanSet::parse("5-3") );
+  REQUIRE_THROWS( VlanSet::parse("4096") );
+}
+
+TEST_CASE("module eeprom decoding", "[netlink]")
+{
+  //eeprom image of the given ETH_MODULE_SFF_* type with bytes set
+  auto eeprom = [](uint32_t type, vector<pair<size_t, uint8_t>> bytes)
+  {
+    vector<uint8_t> ee(type == ETH_MODULE_SFF_8472 ? 512 : 256, 0);
+    for(const auto & b : bytes) ee[b.first] = b.second;
+    return NetLink::decodeModule(type, ee.data(), ee.size());
+  };
+
+  struct Case
+  {
+    const char *what;
+    uint32_t type;
+    vector<pair<size_t, uint8_t>> bytes;
+    string module, media;
+    size_t capSpeed;
+  };
+
+  vector<Case> cases = {
+    {"qsfp28 100GBASE-SR4", ETH_MODULE_SFF_8636,
+      {{128, 0x11}, {131, 0x80}, {192, 0x02}},
+      "qsfp28", "100GBASE-SR4", 100000},
+    {"qsfp28 100GBASE-CR4", ETH_MODULE_SFF_8636,
+      {{128, 0x11}, {131, 0x80}, {192, 0x0b}},
+      "qsfp28", "100GBASE-CR4", 100000},
+    {"qsfp28 no known code", ETH_MODULE_SFF_8636,
+      {{128, 0x11}},
+      "qsfp28", "", 100000},
+    {"qsfp+ 40GBASE-SR4", ETH_MODULE_SFF_8436,
+      {{128, 0x0d}, {131, 0x04}},
+      "qsfp+", "40GBASE-SR4", 40000},
+    {"qsfp+ 40GBASE-CR4", ETH_MODULE_SFF_8436,
+      {{128, 0x0d}, {131, 0x08}},
+      "qsfp+", "40GBASE-CR4", 40000},
+    {"sfp28 25GBASE-SR", ETH_MODULE_SFF_8472,
+      {{0, 0x03}, {36, 0x02}},
+      "sfp28", "25GBASE-SR", 25000},
+    {"sfp28 25GBASE-CR CA-L", ETH_MODULE_SFF_8472,
+      {{0, 0x03}, {36, 0x0b}},
+      "sfp28", "25GBASE-CR CA-L", 25000},
+    {"sfp28 25GBASE-CR CA-S", ETH_MODULE_SFF_8472,
+      {{0, 0x03}, {36, 0x0c}},
+      "sfp28", "25GBASE-CR CA-S", 25000},
+    {"sfp+ 10GBASE-SR", ETH_MODULE_SFF_8472,
+      {{0, 0x03}, {3, 0x10}},
+      "sfp", "10GBASE-SR", 10000},
+    {"sfp four lane only code", ETH_MODULE_SFF_8472,
+      {{0, 0x03}, {36, 0x07}},
+      "sfp", "", 0},
+  };
+
+  for(const auto & c : cases)
+  {
+    INFO( c.what );
+    auto t = eeprom(c.type, c.bytes);
+    REQUIRE( t.module == c.module );
+    REQUIRE( t.media == c.media );
+    REQUIRE( t.capSpeed == c.capSpeed );
+  }
+
+  //what tells two modules of the same kind apart
+  vector<pair<size_t, uint8_t>> bytes{{128, 0x11}};
+  string vendor = "ACME            ", serial = "X1234";
+  for(size_t i=0; i<vendor.size(); ++i) bytes.push_back({148+i, vendor[i]});
+  for(size_t i=0; i<serial.size(); ++i) bytes.push_back({196+i, serial[i]});
+  auto t = eeprom(ETH_MODULE_SFF_8636, bytes);
+  REQUIRE( t.vendor == "ACME" );
+  REQUIRE( t.serial == "X1234" );
+}
+
+/*
+ * vlan membership benchmark
+ * -------------------------
+ *
+ * Builds an augeas root from config/leaf_interfaces with `n` vlans spread
+ * across the downlink access ports and carried by every uplink trunk, then
+ * times the old regex XPath membership query against the model lookup. 
+ * Hidden by default, run with `dcc_test [bench]`.
+ */
+
+static string leafAugroot(size_t n)
+{
+  std::ifstream ifs{here() + "/../config/leaf_interfaces"};
+  std::stringstream buf;
+  buf << ifs.rdbuf();
+  string config = buf.str();
+
+  string vids;
+  for(size_t i=0; i<n; ++i) vids += to_string(100+i) + " ";
+  vids.pop_back();
+
+  config = std::regex_replace(config, std::regex{"bridge-vids 1\n"}, 
+      "bridge-vids " + vids + "\n");
+
+  size_t i{0};
+  string out;
+  std::regex access{"bridge-access 1\n"};
+  std::sregex_iterator it{config.begin(), config.end(), access}, end;
+  size_t last{0};
+  for(; it != end; ++it, ++i)
+  {
+    out += config.substr(last, it->position() - last);
+    out += "bridge-access " + to_string(100 + (i % n)) + "\n";
+    last = it->position() + it->length();
+  }
+  out += config.substr(last);
+
+  return scratchRoot(fmt::format("bench_{}", n), out);
+}
+
+TEST_CASE("vlan membership", "[.][bench]")
+{
+  for(size_t n : {1, 100, 1000})
+  {
+    auto root = leafAugroot(n);
+
+    Augeas aug{root};
+    aug.load();
+    auto t0 = chrono::steady_clock::now();
+    size_t rx_members{0};
+    for(size_t v=100; v<100+n; ++v)
+    {
+      rx_members += aug.match(fmt::format(
+        "/files/etc/network/interfaces/*/bridge-vids[ . =~ regexp('.*{}.*') ]",
+        v)).size();
+      rx_members += aug.match(fmt::format(
+        "/files/etc/network/interfaces/*/bridge-access[ . = '{}' ]", 
+        v)).size();
+    }
+    auto t1 = chrono::steady_clock::now();
+
+    Dcc dcc{root};
+    dcc.listVlans(); //builds the model
+    auto t2 = chrono::steady_clock::now();
+    auto vlans = dcc.listVlans();
+    auto t3 = chrono::steady_clock::now();
+
+    size_t members{0};
+    for(const auto & v : vlans) members += v.members.size();
+
+    using ms = chrono::duration<double, std::milli>;
+    std::cout << n << " vlans: "
+      << "regex " << ms(t1-t0).count() << " ms (" << rx_members << "), "
+      << "model " << ms(t3-t2).count() << " ms (" << members << ")"
+      << std::endl;
+
+    REQUIRE( vlans.size() == n );
+    REQUIRE( members <= rx_members );
+  }
+}
+
+/*
+ * link modes benchmark
+ * --------------------
+ *
+ * Serial against pooled ethtool probes of n ports. This is the path of the
+ * monitor's resync and carrier change probes and of links() without the 
+ * monitor, listings with the monitor running never probe.
+ */
+
+TEST_CASE("link modes", "[.][bench]")
+{
+  vector<string> names;
+  for(const auto & l : NetLink::links()) names.push_back(l.name);
+
+  for(size_t n : {1, 16, 64, 128, 256})
+  {
+    vector<string> ifxs;
+    for(size_t i=0; i<n && !names.empty(); ++i) 
+      ifxs.push_back(names[i % names.size()]);
+
+    auto t0 = chrono::steady_clock::now();
+    auto serial = NetLink::linkModes(ifxs, 1);
+    auto t1 = chrono::steady_clock::now();
+    auto parallel = NetLink::linkModes(ifxs);
+    auto t2 = chrono::steady_clock::now();
+
+    using ms = chrono::duration<double, std::milli>;
+    std::cout << n << " ports: "
+      << "serial " << ms(t1-t0).count() << " ms, "
+      << "parallel " << ms(t2-t1).count() << " ms"
+      << std::endl;
+
+    REQUIRE( serial.size() == ifxs.size() );
+    for(size_t i=0; i<ifxs.size(); ++i)
+      REQUIRE( serial[i].speed == parallel[i].speed );
+  }
+}
+
+/*
+ * augeas startup benchmark
+ * ------------------------
+ *
+ * Init, first load and a forced reload of the leaf root, with every lens
+ * autoloaded and every file they cover parsed as augeas does by default,
+ * against the Augeas wrapper that loads only the interfaces lens and files.
+ */
+
+TEST_CASE("augeas startup", "[.][bench]")
+{
+  using ms = chrono::duration<double, std::milli>;
+  auto root = leafAugroot(10);
+  string ifaces = "/files/etc/network/interfaces/iface";
+
+  auto t0 = chrono::steady_clock::now();
+  augeas *full = aug_init(root.c_str(), nullptr, AUG_NONE);
+  auto t1 = chrono::steady_clock::now();
+  aug_load(full);
+  auto t2 = chrono::steady_clock::now();
+  char **found{nullptr};
+  int nfull = aug_match(full, ifaces.c_str(), &found);
+  for(int i=0; i<nfull; ++i) free(found[i]);
+  free(found);
+  aug_close(full);
+
+  //the constructor does not load, the first load() does
+  auto t3 = chrono::steady_clock::now();
+  Augeas aug{root};
+  aug.load();
+  auto t4 = chrono::steady_clock::now();
+  aug.reload();
+  auto t5 = chrono::steady_clock::now();
+  size_t nleaf = aug.match(ifaces).size();
+
+  std::cout 
+    << "autoload: startup " << ms(t2-t0).count() << " ms "
+    << "(load " << ms(t2-t1).count() << " ms)" << std::endl
+    << "interfaces only: startup " << ms(t4-t3).count() << " ms, "
+    << "reload " << ms(t5-t4).count() << " ms" << std::endl;
+
+  REQUIRE( nfull > 0 );
+  REQUIRE( nleaf == size_t(nfull) );
+}
+
+/*
+ * port fragments benchmark
+ * ------------------------
+ *
+ * Ten single port vlan changes on the leaf root, once with the monolithic
+ * interfaces file and once with a fragment per port. Counts the bytes of 
+ * every file augeas replaced, it renames a new file into place so a changed
+ * inode means the whole file was written.
+ */
+
+static size_t written(const string & root, std::map<string, ino_t> & seen)
+{
+  size_t bytes{0};
+  glob_t g;
+  string pat = root + "/etc/network/{interfaces,interfaces.d/*}";
+  if(glob(pat.c_str(), GLOB_BRACE, nullptr, &g) != 0) return 0;
+  for(size_t i=0; i<g.gl_pathc; ++i)
+  {
+    struct stat st;
+    if(stat(g.gl_pathv[i], &st) != 0) continue;
+    auto & ino = seen[g.gl_pathv[i]];
+    if(ino != st.st_ino) bytes += st.st_size;
+    ino = st.st_ino;
+  }
+  globfree(&g);
+  return bytes;
+}
+
+TEST_CASE("port fragments", "[.][bench]")
+{
+  for(bool fragments : {false, true})
+  {
+    //an empty interfaces.d, as the switch ships with
+    auto root = leafAugroot(10);
+    string frags = root + "/etc/network/interfaces.d";
+    std::system(("rm -rf " + frags).c_str());
+    mkdir(frags.c_str(), 0755);
+
+    Dcc dcc{root};
+    dcc.options.activate = false;
+    dcc.options.commitWindow = chrono::milliseconds{0};
+    dcc.options.fragments = fragments;
+    dcc.start(); //loads, and moves the stanzas out with fragments
+
+    std::map<string, ino_t> seen;
+    written(root, seen);
+
+    size_t bytes{0};
+    for(size_t i=0; i<10; ++i)
+    {
+      dcc.setPortVlan({fmt::format("swp{}s{}", 1 + i/4, i%4)}, 200 + i);
+      bytes += written(root, seen);
+    }
+
+    std::cout << (fragments ? "fragments: " : "monolithic: ") 
+      << bytes << " bytes written" << std::endl;
+
+    REQUIRE( bytes > 0 );
+  }
+}
+
+/*
+ * augeas lookups benchmark
+ * ------------------------
+ *
+ * The augeas matches a vlan change on four ports, one of them a trunk, makes
+ * while editing and saving. The edits go through the iface path index so
+ * none should be left.
+ */
+
+TEST_CASE("augeas lookups", "[.][bench]")
+{
+  auto root = leafAugroot(10);
+  std::system(("rm -rf " + root + "/etc/network/interfaces.d").c_str());
+
+  Dcc dcc{root};
+  dcc.options.activate = false;
+  dcc.options.commitWindow = chrono::milliseconds{0};
+  dcc.listVlans();
+
+  auto r = dcc.setPortVlan({"swp1s0", "swp1s1", "swp1s2", "swp9"}, 200);
+  auto m = dcc.metrics();
+
+  std::cout << "setPortVlan on 4 ports: " << r.augMatches << " matches, "
+    << m.augMatches << " since startup (" << m.augLoads << " loads, " 
+    << m.augSaves << " saves)" << std::endl;
+
+  REQUIRE( r.augMatches == 0 );
+}
@@ -26,8 +26,12 @@
 #include <gflags/gflags.h>
 #include <map>
 #include <mutex>
+#include <atomic>
+#include <unordered_map>
 #include "dcc.hxx"
+#include "netlink.hxx"
 #include "pipes.hxx"
+#include "jobs.hxx"
 
 using std::experimental::optional;
 using std::experimental::make_optional;
@@ -39,6 +43,8 @@ using std::find_if;
 using std::string;
 using std::function;
 using std::exception;
+using std::runtime_error;
+using std::pair;
 using std::mutex;
 using std::lock_guard;
 using std::thread;
@@ -47,7 +53,34 @@ using namespace httpd;
 //using Json = nlohmann::json;
 
 //static globals
-Dcc dcc;
+unique_ptr<Dcc> dcc;
+unique_ptr<Jobs> jobs;
+
+//flags
+DEFINE_bool(netlink_apply, true, 
+    "program bridge vlans directly over netlink, falling back to ifup");
+DEFINE_string(apply_fallback, "ifup",
+    "how to activate ports netlink can't program: ifup or ifreload");
+DEFINE_int32(module_sweep, 60,
+    "seconds between sweeps for transceivers plugged into ports that are down");
+DEFINE_int32(job_workers, 4,
+    "workers running asynchronous requests, disjoint ports run in parallel");
+DEFINE_int32(commit_window_ms, 10,
+    "milliseconds a mutation waits for others to share its save and apply");
+DEFINE_bool(pretty_json, false,
+    "indent response bodies, requests can also ask with \"pretty\": true");
+DEFINE_string(augeas_root, "",
+    "root the interfaces files are read under, AUGEAS_ROOT or / when empty");
+DEFINE_bool(port_fragments, false,
+    "keep each port in its own /etc/network/interfaces.d/<port>.intf");
+DEFINE_bool(prune_uplinks, false,
+    "keep the uplink trunks carrying only the vlans of the downlinks");
+DEFINE_string(uplinks, "^swp(9|1[0-9]|2[0-4])$",
+    "regex matching the uplink ports pruned by prune_uplinks");
+DEFINE_string(downlinks, "^swp[1-9][0-9]?s[0-3]$",
+    "regex matching the downlink ports whose vlans the uplinks carry");
+DEFINE_string(uplink_keep, "1",
+    "vlans the uplinks carry regardless of the downlinks, bridge-vids syntax");
 
 //api level functions
 void ding();
@@ -55,6 +88,8 @@ void listVlans();
 void findVlans();
 void vlanHasPorts();
 void listPorts();
+void portStats();
+void metrics();
 void disablePortTrunking();
 void enablePortTrunking();
 void setVlansOnTrunk();
@@ -65,21 +100,70 @@ void removePortsFromVlan();
 void removeSomePortsFromVlan();
 void portControl();
 void createVlan();
+void batch();
+void jobStatus();
 
 
 Server &srv = Server::get();
-static mutex mtx{};
 
+//responses are compact unless asked otherwise, snmpit doesn't read them
+static string dump(const Json & j, bool pretty = false)
+{
+  return j.dump(pretty || FLAGS_pretty_json ? 2 : -1);
+}
+
+static bool pretty(const Json & request)
+{
+  return request.is_object() && request.value("pretty", false);
+}
+
+/*
+ * Serialized bodies of the read endpoints snmpit polls. An entry is kept
+ * until one of the versions it was built from moves, a version of 0 means
+ * there is nothing to go by and the body is built every time.
+ */
+class BodyCache
+{
+  public:
+    string get(const string & key, const vector<uint64_t> & versions, 
+        function<string()> build)
+    {
+      bool cacheable = 
+        find(versions.begin(), versions.end(), 0) == versions.end();
+
+      if(cacheable)
+      {
+        lock_guard<mutex> lk{mtx_};
+        auto i = bodies_.find(key);
+        if(i != bodies_.end() && i->second.first == versions) 
+          return i->second.second;
+      }
+
+      //versions were read before building, so a change that races the 
+      //build only costs a rebuild on the next call
+      string body = build();
+      if(!cacheable) return body;
+
+      lock_guard<mutex> lk{mtx_};
+      if(bodies_.size() >= 256) bodies_.clear();
+      bodies_[key] = {versions, body};
+      return body;
+    }
 
-//TODO: perform finer grained locking in dcc itself later
+  private:
+    mutex mtx_;
+    std::unordered_map<string, pair<vector<uint64_t>, string>> bodies_;
+};
+static BodyCache bodies;
 
+//handlers run concurrently, Dcc does its own locking so that readers never
+//wait on a writer, the only state kept here is the vlan map
 static void safePost(string path, function<Response(PostRequest)> handler)
 {
   auto safe_handler = [handler, path](PostRequest m)
   {
     try
     { 
-      lock_guard<mutex> lk{mtx};
       return handler(m); 
     }
     catch(exception &e)
@@ -88,7 +172,7 @@ static void safePost(string path, function<Response(PostRequest)> handler)
       Json r;
       r["result"] = "exception";
       r["info"] = e.what();
-      return Response{ Status::ServerError, r.dump(2) };
+      return Response{ Status::ServerError, dump(r) };
     }
   };
   srv.onPost(path, safe_handler);
@@ -100,7 +184,6 @@ static void safeGet(string path, function<Response(GetRequest)> handler)
   {
     try
     { 
-      lock_guard<mutex> lk{mtx};
       return handler(m); 
     }
     catch(exception &e)
@@ -109,16 +192,92 @@ static void safeGet(string path, function<Response(GetRequest)> handler)
       Json r;
       r["result"] = "exception";
       r["info"] = e.what();
-      return Response{ Status::ServerError, r.dump(2) };
+      return Response{ Status::ServerError, dump(r) };
     }
   };
   srv.onGet(path, safe_handler);
 }
 
+//what happened to each port a finished request touched
+static Json portOutcomes(const Json & request, const Json & result)
+{
+  std::map<string, string> ports;
+
+  string fallback = 
+    result.value("result", "") == "fail" ? "failed" :
+    result.count("apply") ? "unchanged" : "ok";
+  if(request.count("ports") && request["ports"].is_array())
+  {
+    for(string ifx : request["ports"]) ports[ifx] = fallback;
+  }
+  if(request.count("port")) ports[request["port"]] = fallback;
+
+  if(result.count("apply"))
+  {
+    const Json & a = result["apply"];
+    string strategy = a.at("strategy");
+    string cycled = strategy.substr(strategy.rfind('+') + 1);
+    if(!a.at("ok")) cycled = "failed";
+
+    for(string ifx : a.at("netlink")) ports[ifx] = "netlink";
+    for(string ifx : a.at("cycled")) ports[ifx] = cycled;
+  }
+
+  auto errors = result.find("errors");
+  if(errors != result.end())
+  {
+    for(auto e = errors->begin(); e != errors->end(); ++e) 
+      ports[e.key()] = "failed: " + e.value().get<string>();
+  }
+
+  return ports;
+}
+
+//a post that changes the switch, with "async": true in the request the 
+//handler runs as a job and the caller gets its id back straight away
+static void mutatingPost(string path, function<Json(Json)> handler)
+{
+  safePost(path, [handler, path](PostRequest m)
+  {
+    Json request = Json::parse(m.data);
+
+    if(request.is_object() && request.value("async", false))
+    {
+      size_t id = jobs->submit(path, [handler, request]()
+      {
+        Json result = handler(request);
+        result["ports"] = portOutcomes(request, result);
+        return result;
+      });
+
+      Json result;
+      result["result"] = "queued";
+      result["job"] = id;
+      return Response{ Status::OK, dump(result, pretty(request)) };
+    }
+
+    return Response{ Status::OK, dump(handler(request), pretty(request)) };
+  });
+}
+
+//fill in the result and apply of a mutation that went through dcc
+static void applied(Json & result, const ApplyResult & r)
+{
+  result["result"] = r.ok ? "ok" : "fail";
+  result["apply"] = r.json();
+  if(!r.ok) result["info"] = "saved but not activated on the switch";
+}
+
 std::map<size_t, string> vmap;
+static mutex vmapMtx{};
+
+//bumped on every change to vmap, for the response cache
+static std::atomic<uint64_t> vmapVersion{1};
 
 static void saveVmap()
 {
+  ++vmapVersion;
+
   std::vector<Json> j;
   for(auto p : vmap) j.push_back(Json::array({p.first, p.second}));
   std::ofstream ofs{"/tmp/vmap.json"};
@@ -139,6 +298,20 @@ static optional<size_t> vlanNumber(string vid)
   else return optional<size_t>{};
 }
 
+//record vid under vnumber or the next free number if that is taken, 
+//returns the number used, caller holds vmapMtx
+static size_t mapVlan(string vid, size_t vnumber)
+{
+  auto x = vmap.find(vnumber);
+  if (x != vmap.end())
+  {
+    vnumber = vmap.rbegin()->first + 1; //remember this is an _ordered_ map
+  }
+
+  vmap[vnumber] = vid;
+  return vnumber;
+}
+
 static void loadVmap()
 {
   std::ifstream ifs{"/tmp/vmap.json"};
@@ -173,7 +346,52 @@ int main(int argc, char **argv)
   prctl(PR_SET_DUMPABLE, 1); 
   LOG(INFO) << "dcc starting";
 
+  dcc.reset(new Dcc(FLAGS_augeas_root));
+  dcc->options.netlinkApply = FLAGS_netlink_apply;
+  dcc->options.fragments = FLAGS_port_fragments;
+  dcc->options.commitWindow = 
+    std::chrono::milliseconds{std::max(FLAGS_commit_window_ms, 0)};
+  if(FLAGS_apply_fallback == "ifreload")
+    dcc->options.fallback = Dcc::Fallback::Ifreload;
+  else if(FLAGS_apply_fallback != "ifup")
+    LOG(WARNING) << "unknown apply_fallback " << FLAGS_apply_fallback 
+                 << ", using ifup";
+
+  try
+  {
+    dcc->options.pruneUplinks = FLAGS_prune_uplinks;
+    dcc->options.uplinks = std::regex{FLAGS_uplinks};
+    dcc->options.downlinks = std::regex{FLAGS_downlinks};
+    dcc->options.uplinkKeep = VlanSet::parse(FLAGS_uplink_keep);
+
+    //an uplink without bridge-vids carries every vlan of the bridge
+    if(FLAGS_prune_uplinks && dcc->options.uplinkKeep.empty())
+      throw runtime_error{"uplink_keep needs at least one vlan"};
+  }
+  catch(exception &e)
+  {
+    LOG(FATAL) << "bad uplink pruning flags: " << e.what();
+  }
+
+  dcc->start();
+
+  if(FLAGS_prune_uplinks)
+  {
+    try { dcc->syncUplinks(); }
+    catch(exception &e) 
+    { 
+      LOG(WARNING) << "initial uplink pruning failed: " << e.what(); 
+    }
+  }
+
   loadVmap();
+  jobs.reset(new Jobs(std::max(FLAGS_job_workers, 1)));
+
+  try { NetLink::monitor(std::max(FLAGS_module_sweep, 1)); }
+  catch(exception &e) 
+  { 
+    LOG(WARNING) << "link monitor unavailable: " << e.what(); 
+  }
 
   //handlers
   ding();
@@ -181,6 +399,8 @@ int main(int argc, char **argv)
   findVlans();
   vlanHasPorts();
   listPorts();
+  portStats();
+  metrics();
   disablePortTrunking();
   enablePortTrunking();
   setVlansOnTrunk();
@@ -191,11 +411,42 @@ int main(int argc, char **argv)
   removeSomePortsFromVlan();
   portControl();
   createVlan();
+  batch();
+  jobStatus();
 
   //go
   srv.run();
 }
 
+/*
+ * Mutating calls report how their change was activated on the switch 
+ *
+ *  apply:
+ *    {
+ *      strategy: none | netlink | ifup | ifreload | netlink+ifup ...,
+ *      ms: wall time of the activation,
+ *      ok: false if netlink or ifupdown failed,
+ *      netlink: [ports programmed over netlink],
+ *      cycled: [ports handed to ifupdown],
+ *      batched: requests saved and applied together with this one,
+ *      aug_matches: augeas lookups made while editing and saving
+ *    }
+ *
+ * When apply.ok is false the change is saved but did not make it onto the
+ * switch, and result is "fail" rather than "ok"
+ *
+ * They also take "async": true, in which case the response is
+ *
+ *    { result: "queued", job: <id> }
+ *
+ * and the request runs on a dcc worker, see jobStatus
+ *
+ * Responses are compact json, posts that carry "pretty": true and every 
+ * response when running with --pretty_json are indented. /listVlans, 
+ * /findVlans and /listPorts bodies are cached until the switch state, the 
+ * link table or the vlan map change
+ */
+
 /* -----------------------------------------------------------------------------
  * ding
  * -----
@@ -230,19 +481,14 @@ void createVlan()
     string vid = request.at("vlan_id");
     size_t vnumber = request.at("vlan_number");
 
-    auto x = vmap.find(vnumber);
-    if (x != vmap.end())
-    {
-      vnumber = vmap.rbegin()->first + 1; //remember this is an _ordered_ map
-    }
-
-    vmap[vnumber] = vid;
+    lock_guard<mutex> lk{vmapMtx};
+    vnumber = mapVlan(vid, vnumber);
     saveVmap();
 
     Json result;
     result["vlan_number"] = vnumber;
 
-    return Response{ Status::OK, result.dump(2) };
+    return Response{ Status::OK, dump(result, pretty(request)) };
 
   });
 }
@@ -262,13 +508,20 @@ void listVlans()
 
     using namespace pipes;
 
-    Json j =
-      dcc.listVlans()
-      | map([](const auto &i){
-          return Json::array({vmap[i.deterId], i.cumulusId, i.members});
-        });
+    auto body = bodies.get("/listVlans", {dcc->version(), vmapVersion}, []
+    {
+      auto vlans = dcc->listVlans();
 
-    return Response{ Status::OK, j.dump(2) };
+      lock_guard<mutex> lk{vmapMtx};
+      Json j =
+        vlans
+        | map([](const auto &i){
+            return Json::array({vmap[i.deterId], i.cumulusId, i.members});
+          });
+      return dump(j);
+    });
+
+    return Response{ Status::OK, body };
 
   });
 }
@@ -284,41 +537,47 @@ void findVlans()
 {
   safePost("/findVlans", [](PostRequest m) {
 
-    //vector<size_t> vlans = m.bodyAsJson();
-    vector<string> vlans = Json::parse(m.data);
+    auto body = bodies.get("/findVlans " + m.data, {vmapVersion}, [&m]
+    {
+      //vector<size_t> vlans = m.bodyAsJson();
+      vector<string> vlans = Json::parse(m.data);
 
-    vector<Json> r;
+      vector<Json> r;
 
-    if(vlans.empty())
-    {
-      for(auto p : vmap)
+      lock_guard<mutex> lk{vmapMtx};
+      if(vlans.empty())
       {
-        r.push_back(Json::array({p.first, p.second}));
+        for(auto p : vmap)
+        {
+          r.push_back(Json::array({p.first, p.second}));
+        }
       }
-    }
-    else
-    {
-      for(string vid : vlans)
+      else
       {
-        auto vn = vlanNumber(vid);
-        if(vn) r.push_back(Json::array({*vn, vid}));
-        else   r.push_back(Json::array({nullptr, vid}));
+        for(string vid : vlans)
+        {
+          auto vn = vlanNumber(vid);
+          if(vn) r.push_back(Json::array({*vn, vid}));
+          else   r.push_back(Json::array({nullptr, vid}));
+        }
       }
-    }
 
-    Json j = r;
+      Json j = r;
 
-    /*
-    Json j = 
-      dcc.findVlans(vlans)
-      | map([](const auto &p)
-        {
-          if(p.second) return Json::array({p.first, *p.second});
-          else         return Json::array({p.first, nullptr});
-        });
-    */
+      /*
+      Json j = 
+        dcc->findVlans(vlans)
+        | map([](const auto &p)
+          {
+            if(p.second) return Json::array({p.first, *p.second});
+            else         return Json::array({p.first, nullptr});
+          });
+      */
 
-    return Response{ Status::OK, j.dump(2) };
+      return dump(j);
+    });
+
+    return Response{ Status::OK, body };
 
   });
 }
@@ -343,9 +602,9 @@ void vlanHasPorts()
       size_t vlanId = request.at("id");
 
       Json result; 
-      result["exists"] = dcc.vlanHasPorts(vlanId);
+      result["exists"] = dcc->vlanHasPorts(vlanId);
 
-      return Response{ Status::OK, result.dump(2) };
+      return Response{ Status::OK, dump(result, pretty(request)) };
 
   });
 }
@@ -356,6 +615,9 @@ void vlanHasPorts()
  *
  *  response:
  *    ports: json - a json object that is a list of PortInfo objects
+ *      [name, enabled, link, linkSpeed, duplex, capSpeed]
+ *    capSpeed is what the plugged in transceiver supports, 0Mbps when no
+ *    module is present or it has not been read yet
  */
 
 void listPorts()
@@ -364,22 +626,89 @@ void listPorts()
 
       using namespace pipes;
 
-      Json j = 
-        dcc.getInterfaces()
-        | filter([](const auto &i) { return i.name == "eth0"; })
-        | map([](const auto &i){
+      vector<uint64_t> versions{dcc->version(), NetLink::generation()};
+      auto body = bodies.get("/listPorts", versions, []
+      {
+        Json j = 
+          dcc->getInterfaces()
+          | filter([](const auto &i) { return i.name == "eth0"; })
+          | map([](const auto &i){
+
+              return Json::array({
+                  i.name, 
+                  i.enabled ? "yes" : "no", 
+                  i.link ? "up" : "down", 
+                  to_string(i.linkSpeed) + "Mbps", 
+                  i.duplex,
+                  to_string(i.capSpeed) + "Mbps"
+              });
 
-            return Json::array({
-                i.name, 
-                i.enabled ? "yes" : "no", 
-                i.link ? "up" : "down", 
-                to_string(i.linkSpeed) + "Mbps", 
-                i.duplex
             });
+        return dump(j);
+      });
 
-          });
+     return Response{ Status::OK, body };
+  });
+}
+
+/* -----------------------------------------------------------------------------
+ * portStats
+ * ---------
+ *
+ *  parameters:
+ *    - { ports: [<ifx>], delta: <bool> } both optional, all ports by default
+ *
+ *  response:
+ *    a list of per port counters
+ *      {
+ *        name: <ifx>,
+ *        rx: { bytes, packets, errors, dropped },
+ *        tx: { bytes, packets, errors, dropped },
+ *        interval: seconds since the previous sample (delta only),
+ *        rate: { rx_bps, tx_bps, rx_pps, tx_pps } (delta only)
+ *      }
+ *
+ *    with delta set the counters are the change since the previous sample of
+ *    the port, the first sample of a port is always absolute
+ */
+
+void portStats()
+{
+  safePost("/portStats", [](PostRequest m) {
+
+      using namespace pipes;
+
+      Json request = m.data.empty() ? Json::object() : Json::parse(m.data);
+      vector<string> ports = request.value("ports", vector<string>{});
+      bool delta = request.value("delta", false);
+
+      Json j = 
+        dcc->portStats(ports, delta)
+        | map([](const auto &s){ return s.json(); });
+
+      return Response{ Status::OK, dump(j, pretty(request)) };
+  });
+}
+
+/* -----------------------------------------------------------------------------
+ * metrics
+ * -------
+ *
+ *  response:
+ *    {
+ *      mutations: requests that changed the switch,
+ *      commits: saves and applies they took, group commits carry several,
+ *      augeas: { matches, loads, saves } calls into augeas
+ *    }
+ *
+ *  totals since dcc started
+ */
+
+void metrics()
+{
+  safeGet("/metrics", [](GetRequest) {
 
-     return Response{ Status::OK, j.dump(2) };
+      return Response{ Status::OK, dump(dcc->metrics().json()) };
   });
 }
 
@@ -391,22 +720,27 @@ void listPorts()
  *    - { port: <port name> }
  *
  *  response:
- *    { "result": "ok" }
+ *    { "result": "ok", "apply": <how the change was activated> }
+ *    { "result": "fail", "info": "no such interface <port>" }
  */
 
 void disablePortTrunking()
 {
-  safePost("/disablePortTrunking", [](PostRequest m) {
+  mutatingPost("/disablePortTrunking", [](Json request) {
 
-      Json request = Json::parse(m.data);
       string ifx = request.at("port");
 
       Json result;
-      result["result"] = "ok";
 
-      dcc.disablePortTrunking(ifx);
+      auto r = dcc->disablePortTrunking(ifx);
+      if(r) applied(result, *r);
+      else
+      {
+        result["result"] = "fail";
+        result["info"] = "no such interface " + ifx;
+      }
 
-      return Response{ Status::OK, result.dump(2) };
+      return result;
   });
 }
 
@@ -422,14 +756,13 @@ void disablePortTrunking()
  *      }
  *
  *  response:
- *    { "result": "ok" }
+ *    { "result": "ok", "apply": <how the change was activated> }
+ *    { "result": "fail", "info": "no such interface <port>" }
  */
 
 void enablePortTrunking()
 {
-  safePost("/enablePortTrunking", [](PostRequest m) {
-
-      Json request = Json::parse(m.data);
+  mutatingPost("/enablePortTrunking", [](Json request) {
 
       string ifx = request.at("port");
       size_t vlan = request.at("vlan");
@@ -438,10 +771,15 @@ void enablePortTrunking()
 
       Json result;
 
-      bool r = dcc.enablePortTrunking(ifx, vlan, eqtrunk);
-      r ? result["result"] = "ok" : result["result"] = "fail";
+      auto r = dcc->enablePortTrunking(ifx, vlan, eqtrunk);
+      if(r) applied(result, *r);
+      else
+      {
+        result["result"] = "fail";
+        result["info"] = "no such interface " + ifx;
+      }
 
-      return Response{ Status::OK, result.dump(2) };
+      return result;
 
   });
 }
@@ -458,25 +796,21 @@ void enablePortTrunking()
  *      }
  *
  *  response:
- *    { "result": "ok" }
+ *    { "result": "ok", "apply": <how the change was activated> }
  */
 
 void setVlansOnTrunk()
 {
-  safePost("/setVlansOnTrunk", [](PostRequest m) {
-
-    Json request = Json::parse(m.data);
+  mutatingPost("/setVlansOnTrunk", [](Json request) {
 
     string ifx = request.at("port");
     vector<size_t> vlans = request.at("vlans");
     bool allow = request.at("allow");
 
     Json result;
-    result["result"] = "ok";
-
-    dcc.setVlansOnTrunk(ifx, vlans, allow);
+    applied(result, dcc->setVlansOnTrunk(ifx, vlans, allow));
 
-    return Response{ Status::OK, result.dump(2) };
+    return result;
 
   });
 }
@@ -491,90 +825,82 @@ void setVlansOnTrunk()
  *      }
  *
  *  response:
- *    { "result": "ok" }
+ *    { "result": "ok", "apply": <how the change was activated> }
  */
 void removeVlans()
 {
-  safePost("/removeVlans", [](PostRequest m) {
+  mutatingPost("/removeVlans", [](Json request) {
 
-      Json request = Json::parse(m.data);
       vector<size_t> vlans = request.at("vlan");
       Json result;
-      result["result"] = "ok";
-      dcc.removeVlans(vlans);
+      applied(result, dcc->removeVlans(vlans));
+
+      lock_guard<mutex> lk{vmapMtx};
       for(size_t v : vlans) { vmap.erase(v); }
       saveVmap();
-      return Response{ Status::OK, result.dump(2) };
+      return result;
 
   });
 }
 
 void setPortVlan()
 {
-  safePost("/setPortVlan", [](PostRequest m) {
-    
-      Json request = Json::parse(m.data);
+  mutatingPost("/setPortVlan", [](Json request) {
+
       vector<string> ifxs = request.at("ports");
       size_t vlan = request.at("vlan");
-      dcc.setPortVlan(ifxs, vlan); 
+      auto r = dcc->setPortVlan(ifxs, vlan); 
 
       Json result;
-      result["result"] = "ok";
-      return Response{ Status::OK, result.dump(2) };
+      applied(result, r);
+      return result;
   });
 }
 
 void delPortVlan()
 {
 
-  safePost("/delPortVlan", [](PostRequest m) {
+  mutatingPost("/delPortVlan", [](Json request) {
 
-      Json request = Json::parse(m.data);
       vector<string> ifxs = request.at("ports");
       size_t vlan = request.at("vlan");
 
       Json result;
-      result["result"] = "ok";
-      dcc.delPortVlan(ifxs, vlan);
-      return Response{ Status::OK, result.dump(2) };
+      applied(result, dcc->delPortVlan(ifxs, vlan));
+      return result;
   });
 
 }
 
 void removePortsFromVlan()
 {
-  safePost("/removePortsFromVlan", [](PostRequest m) {
+  mutatingPost("/removePortsFromVlan", [](Json request) {
 
-      Json request = Json::parse(m.data);
       vector<size_t> vlans = request.at("vlans");
       
       Json result;
-      result["result"] = "ok";
-      dcc.removePortsFromVlan(vlans);
-      return Response{ Status::OK, result.dump(2) };
+      applied(result, dcc->removePortsFromVlan(vlans));
+      return result;
   });
 }
 
 void removeSomePortsFromVlan()
 {
-  safePost("/removeSomePortsFromVlan", [](PostRequest m) {
+  mutatingPost("/removeSomePortsFromVlan", [](Json request) {
 
-      Json request = Json::parse(m.data);
       size_t vlan = request.at("vlan");
       vector<string> ifxs = request.at("ports");
       
       Json result;
-      result["result"] = "ok";
-      dcc.removeSomePortsFromVlan(vlan, ifxs);
-      return Response{ Status::OK, result.dump(2) };
+      applied(result, dcc->removeSomePortsFromVlan(vlan, ifxs));
+      return result;
   });
 }
 
 void portControl()
 {
-  safePost("/portControl", [](PostRequest m) {
+  mutatingPost("/portControl", [](Json request) {
 
-      Json request = Json::parse(m.data);
       string command = request.at("command");
       vector<string> ifxs = request.at("ports");
 
@@ -599,11 +925,193 @@ void portControl()
       {
         result["result"] = "fail";
         result["info"] = "unknown command `"+command+"`";
-        return Response{ Status::OK, result.dump(2) };
+        return result;
       }
       
-      dcc.portControl(cmd, ifxs);
+      auto errors = dcc->portControl(cmd, ifxs);
+      if(!errors.empty())
+      {
+        result["result"] = "fail";
+        result["errors"] = errors;
+      }
+
+      return result;
+  });
+}
 
-      return Response{ Status::OK, result.dump(2) };
+/* -----------------------------------------------------------------------------
+ * batch
+ * -----
+ *
+ *  parameters:
+ *    - { ops: [<op>] } applied in order, each op names the call it stands for
+ *      and takes that call's parameters
+ *
+ *        { op: "createVlan", vlan_id, vlan_number }
+ *        { op: "setPortVlan", ports, vlan }
+ *        { op: "delPortVlan", ports, vlan }
+ *        { op: "setVlansOnTrunk", port, vlans, allow }
+ *        { op: "enablePortTrunking", port, vlan }
+ *        { op: "disablePortTrunking", port }
+ *        { op: "removeVlans", vlan: [<vlan id>] }
+ *        { op: "removePortsFromVlan", vlans }
+ *        { op: "removeSomePortsFromVlan", vlan, ports }
+ *
+ *  response:
+ *    { 
+ *      "result": "ok", 
+ *      "apply": <how the change was activated>,
+ *      "vlan_numbers": [numbers given to the createVlan ops]
+ *    }
+ *
+ *  the whole batch is validated before anything is changed and saved and
+ *  activated once, if any op is bad the switch is left as it was
+ */
+
+static BatchOp batchOp(size_t i, const Json & j)
+{
+  using K = BatchOp::Kind;
+
+  string op = j.at("op");
+  BatchOp b;
+  if(op == "setPortVlan" || op == "delPortVlan" || 
+     op == "removeSomePortsFromVlan")
+  {
+    b.kind = op == "setPortVlan" ? K::SetPortVlan : 
+             op == "delPortVlan" ? K::DelPortVlan : 
+             K::RemoveSomePortsFromVlan;
+    b.ports = j.at("ports").get<vector<string>>();
+    b.vlans = {j.at("vlan").get<size_t>()};
+  }
+  else if(op == "setVlansOnTrunk")
+  {
+    b.kind = K::SetVlansOnTrunk;
+    b.ports = {j.at("port").get<string>()};
+    b.vlans = j.at("vlans").get<vector<size_t>>();
+    b.allow = j.at("allow");
+  }
+  else if(op == "enablePortTrunking")
+  {
+    b.kind = K::EnablePortTrunking;
+    b.ports = {j.at("port").get<string>()};
+    b.vlans = {j.at("vlan").get<size_t>()};
+  }
+  else if(op == "disablePortTrunking")
+  {
+    b.kind = K::DisablePortTrunking;
+    b.ports = {j.at("port").get<string>()};
+  }
+  else if(op == "removeVlans")
+  {
+    b.kind = K::RemoveVlans;
+    b.vlans = j.at("vlan").get<vector<size_t>>();
+  }
+  else if(op == "removePortsFromVlan")
+  {
+    b.kind = K::RemovePortsFromVlan;
+    b.vlans = j.at("vlans").get<vector<size_t>>();
+  }
+  else
+  {
+    throw runtime_error{
+      "batch op " + to_string(i) + ": unknown op `" + op + "`"};
+  }
+  return b;
+}
+
+void batch()
+{
+  mutatingPost("/batch", [](Json request) {
+
+      //createVlan only touches the vlan map, which is updated once the
+      //switch side has gone through
+      vector<BatchOp> ops;
+      vector<pair<string, size_t>> creates;
+      vector<size_t> removed;
+
+      const Json & jops = request.at("ops");
+      for(size_t i=0; i<jops.size(); ++i)
+      {
+        const Json & j = jops.at(i);
+        if(j.at("op") == "createVlan")
+        {
+          creates.emplace_back(
+              j.at("vlan_id").get<string>(), 
+              j.at("vlan_number").get<size_t>());
+          continue;
+        }
+
+        ops.push_back(batchOp(i, j));
+        if(ops.back().kind == BatchOp::Kind::RemoveVlans)
+        {
+          removed.insert(removed.end(), 
+              ops.back().vlans.begin(), ops.back().vlans.end());
+        }
+      }
+
+      Json result;
+      applied(result, dcc->batch(ops));
+
+      vector<size_t> numbers;
+      lock_guard<mutex> lk{vmapMtx};
+      for(const auto & c : creates) 
+        numbers.push_back(mapVlan(c.first, c.second));
+      for(size_t v : removed) { vmap.erase(v); }
+      saveVmap();
+
+      result["vlan_numbers"] = numbers;
+      return result;
+  });
+}
+
+/* -----------------------------------------------------------------------------
+ * jobStatus
+ * ---------
+ *
+ *  parameters:
+ *    - { id: <job id> } for one job, anything else for all of them
+ *
+ *  response:
+ *    {
+ *      id: <job id>,
+ *      what: <the endpoint that was called>,
+ *      state: queued | running | done | failed,
+ *      ahead: jobs queued before this one (queued only),
+ *      wait_ms: time spent queued,
+ *      run_ms: time spent running so far,
+ *      result: the response of the request with a ports object mapping each 
+ *              port to netlink | ifup | ifreload | unchanged | ok | failed,
+ *      error: why the request threw (failed only)
+ *    }
+ *    or a list of those without result
+ */
+
+void jobStatus()
+{
+  safePost("/jobs", [](PostRequest m) {
+
+      Json request = m.data.empty() ? Json::object() : Json::parse(m.data);
+
+      if(request.is_object() && request.count("id"))
+      {
+        auto job = jobs->get(request["id"]);
+        if(!job)
+        {
+          Json result;
+          result["result"] = "fail";
+          result["info"] = "no such job";
+          return Response{ Status::OK, dump(result, pretty(request)) };
+        }
+        return Response{ Status::OK, dump(job->json(), pretty(request)) };
+      }
+
+      Json j = Json::array();
+      for(const auto & job : jobs->list())
+      {
+        Json x = job.json();
+        x.erase("result");
+        j.push_back(x);
+      }
+      return Response{ Status::OK, dump(j, pretty(request)) };
   });
 }
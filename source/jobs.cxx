@@ -0,0 +1,182 @@
+#include "jobs.hxx"
+#include <stdexcept>
+#include <algorithm>
+#include <glog/logging.h>
+
+using std::string;
+using std::vector;
+using std::function;
+using std::mutex;
+using std::lock_guard;
+using std::unique_lock;
+using std::thread;
+using std::exception;
+using std::experimental::optional;
+using std::experimental::make_optional;
+namespace chrono = std::chrono;
+using namespace deter;
+
+constexpr size_t Jobs::retain;
+
+Jobs::Jobs(size_t workers)
+{
+  for(size_t i=0; i<std::max<size_t>(workers, 1); ++i)
+    workers_.emplace_back([this]{ work(); });
+}
+
+//jobs still queued never run, they are failed so they have an outcome
+Jobs::~Jobs()
+{
+  {
+    lock_guard<mutex> lk{mtx_};
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for(auto & w : workers_) w.join();
+
+  lock_guard<mutex> lk{mtx_};
+  auto now = chrono::steady_clock::now();
+  for(size_t id : queue_)
+  {
+    Job & j = jobs_[id];
+    j.started = j.finished = now;
+    j.error = "shut down before the job ran";
+    j.state = Job::State::Failed;
+    LOG(WARNING) << "job " << id << " dropped: " << j.what;
+  }
+  queue_.clear();
+  pending_.clear();
+}
+
+size_t Jobs::submit(string what, function<Json()> f)
+{
+  size_t id;
+  {
+    lock_guard<mutex> lk{mtx_};
+    id = next_++;
+
+    Job j;
+    j.id = id;
+    j.what = what;
+    j.queued = chrono::steady_clock::now();
+    jobs_[id] = j;
+    pending_[id] = f;
+    queue_.push_back(id);
+  }
+  cv_.notify_one();
+
+  LOG(INFO) << "job " << id << " queued: " << what;
+  return id;
+}
+
+optional<Job> Jobs::get(size_t id)
+{
+  lock_guard<mutex> lk{mtx_};
+  auto i = jobs_.find(id);
+  if(i == jobs_.end()) return optional<Job>{};
+
+  Job j = i->second;
+  if(j.state == Job::State::Queued)
+  {
+    for(size_t q : queue_) 
+    {
+      if(q == id) break;
+      ++j.ahead;
+    }
+  }
+  return make_optional(j);
+}
+
+vector<Job> Jobs::list()
+{
+  vector<Job> js;
+  lock_guard<mutex> lk{mtx_};
+  for(const auto & j : jobs_) js.push_back(j.second);
+  return js;
+}
+
+void Jobs::work()
+{
+  for(;;)
+  {
+    size_t id;
+    function<Json()> f;
+    {
+      unique_lock<mutex> lk{mtx_};
+      cv_.wait(lk, [this]{ return stop_ || !queue_.empty(); });
+      if(stop_) return;
+
+      id = queue_.front();
+      queue_.pop_front();
+      f = std::move(pending_[id]);
+      pending_.erase(id);
+
+      Job & j = jobs_[id];
+      j.state = Job::State::Running;
+      j.started = chrono::steady_clock::now();
+    }
+
+    Json result;
+    string error;
+    bool failed{true};
+    try 
+    { 
+      result = f(); 
+      failed = false;
+    }
+    catch(exception &e) { error = e.what(); }
+    catch(...) { error = "unknown error"; }
+
+    lock_guard<mutex> lk{mtx_};
+    Job & j = jobs_[id];
+    j.finished = chrono::steady_clock::now();
+    j.result = result;
+    j.error = error;
+    j.state = failed ? Job::State::Failed : Job::State::Done;
+
+    LOG(INFO) << "job " << id << (failed ? " failed: " : " done") << error;
+
+    //forget the oldest finished jobs, ids only go up so that is the front
+    while(jobs_.size() > retain)
+    {
+      auto oldest = std::find_if(jobs_.begin(), jobs_.end(), [](auto & x){
+          return x.second.state == Job::State::Done || 
+                 x.second.state == Job::State::Failed;
+      });
+      if(oldest == jobs_.end()) break;
+      jobs_.erase(oldest);
+    }
+  }
+}
+
+Json Job::json() const
+{
+  using ms = chrono::duration<double, std::milli>;
+  auto now = chrono::steady_clock::now();
+
+  Json j;
+  j["id"] = id;
+  j["what"] = what;
+  switch(state)
+  {
+    case State::Queued: 
+      j["state"] = "queued"; 
+      j["ahead"] = ahead;
+      j["wait_ms"] = ms(now - queued).count();
+      break;
+    case State::Running: 
+      j["state"] = "running"; 
+      j["wait_ms"] = ms(started - queued).count();
+      j["run_ms"] = ms(now - started).count();
+      break;
+    case State::Done: 
+    case State::Failed: 
+      j["state"] = state == State::Done ? "done" : "failed";
+      j["wait_ms"] = ms(started - queued).count();
+      j["run_ms"] = ms(finished - started).count();
+      if(state == State::Done) j["result"] = result;
+      else j["error"] = error;
+      break;
+  }
+  return j;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+#include <experimental/optional>
+#include "json.hxx"
+
+namespace deter
+{
+  using Json = nlohmann::json;
+
+  /*
+   * A request that was accepted and runs in the background, what it did is
+   * whatever the request would have answered had it been run synchronously
+   */
+  struct Job
+  {
+    enum class State { Queued, Running, Done, Failed };
+
+    size_t id{0};
+    std::string what;
+    State state{State::Queued};
+
+    //jobs queued ahead of this one when it was looked at
+    size_t ahead{0};
+
+    std::chrono::steady_clock::time_point queued, started, finished;
+
+    //the response of the request, or why it threw
+    Json result;
+    std::string error;
+
+    Json json() const;
+  };
+
+  class Jobs
+  {
+    public:
+      Jobs(size_t workers);
+      ~Jobs();
+
+      size_t submit(std::string what, std::function<Json()> work);
+
+      std::experimental::optional<Job> get(size_t id);
+      std::vector<Job> list();
+
+    private:
+      void work();
+
+      std::mutex mtx_;
+      std::condition_variable cv_;
+      bool stop_{false};
+      size_t next_{1};
+      std::deque<size_t> queue_;
+      std::map<size_t, Job> jobs_;
+      std::map<size_t, std::function<Json()>> pending_;
+      std::vector<std::thread> workers_;
+
+      //finished jobs kept around for the controller to pick up
+      static constexpr size_t retain{1024};
+  };
+}
@@ -1,7 +1,20 @@
 #include "netlink.hxx"
 #include <stdexcept>
 #include <bitset>
+#include <map>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+#include <sys/time.h>
 #include <linux/ethtool.h>
+#include <linux/if_bridge.h>
+#include <errno.h>
 #include <iostream>
 #include <glog/logging.h>
 #include <fmt/format.h>
@@ -10,9 +23,30 @@ using namespace deter;
 using std::vector;
 using std::string;
 using std::bitset;
+using std::map;
+using std::set;
+using std::pair;
+using std::function;
+using std::mutex;
+using std::lock_guard;
+using std::thread;
+using std::unordered_map;
 using std::runtime_error;
 
 int NetLink::testSock_{0};
+int NetLink::sock_{-1};
+uint32_t NetLink::seq_{0};
+mutex NetLink::mtx_;
+size_t NetLink::rxBytes_{32768};
+size_t NetLink::rxMessages_{64};
+std::atomic<int> NetLink::monSock_{-1};
+mutex NetLink::linkMtx_;
+mutex NetLink::invMtx_;
+std::condition_variable NetLink::invCv_;
+vector<pair<int, string>> NetLink::invQueue_;
+unordered_map<string, int> NetLink::indexes_;
+unordered_map<int, NetLink::Link> NetLink::links_;
+uint64_t NetLink::generation_{0};
 
 int NetLink::testSock()
 {
@@ -40,76 +74,325 @@ NetLink::Request::Request()
   msg.ifi_change = 0xffffffff;
 }
 
-int NetLink::tx(Request req)
+/*
+ * One rtnetlink socket is opened on first use and kept for the life of the 
+ * process. Requests are tagged with increasing sequence numbers so replies 
+ * to anything we gave up on earlier are recognized and skipped, and mtx_ 
+ * keeps request/reply pairs from interleaving.
+ */
+int NetLink::sock()
 {
+  if(sock_ >= 0) return sock_;
+
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if(fd < 0) 
+  {
+    LOG(ERROR) << "failed to open netlink socket";
+    throw runtime_error{"failed to open netlink socket"};
+  }
+
   sockaddr_nl sa;
-  iovec iov = {&req, req.header.nlmsg_len};
-  msghdr msg = {&sa, sizeof(sa), &iov, 1, nullptr, 0, 0};
   memset(&sa, 0, sizeof(sa));
   sa.nl_family = AF_NETLINK;
+  if(bind(fd, (sockaddr*)&sa, sizeof(sa)) < 0)
+  {
+    close(fd);
+    LOG(ERROR) << "failed to bind netlink socket";
+    throw runtime_error{"failed to bind netlink socket"};
+  }
 
-  int fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
-  sendmsg(fd, &msg, 0);
+  //the kernel always answers, this only guards against a wedged driver
+  timeval tv{5, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
-  return fd;
+  //error acks echo only the header of the failed request rather than all of
+  //it, and carry the reason as text. Older kernels refuse these, which acks
+  //copes with
+#ifdef NETLINK_CAP_ACK
+  int one{1};
+  setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+#ifdef NETLINK_EXT_ACK
+  setsockopt(fd, SOL_NETLINK, NETLINK_EXT_ACK, &one, sizeof(one));
+#endif
+#endif
+
+  sock_ = fd;
+  return sock_;
 }
 
-NetLink::Response NetLink::rx(int fd)
+void NetLink::send(const void *buf, size_t len)
 {
-  size_t rxd{0};
   sockaddr_nl sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.nl_family = AF_NETLINK;
+  iovec iov = {(void*)buf, len};
+  msghdr msg = {&sa, sizeof(sa), &iov, 1, nullptr, 0, 0};
 
-  char buf[16192];
+  if(sendmsg(sock(), &msg, 0) < 0)
+  {
+    string err = fmt::format("netlink sendmsg failed: {}", strerror(errno));
+    LOG(ERROR) << err;
+    throw runtime_error{err};
+  }
+}
+
+//the text the kernel gave with an error ack, empty without NETLINK_EXT_ACK
+string NetLink::extAck(const nlmsghdr *nh)
+{
+#ifdef NETLINK_EXT_ACK
+  if(!(nh->nlmsg_flags & NLM_F_ACK_TLVS)) return "";
+
+  const nlmsgerr *err = (const nlmsgerr*)NLMSG_DATA(nh);
+  size_t off = sizeof(nlmsgerr);
+  if(!(nh->nlmsg_flags & NLM_F_CAPPED))
+    off += err->msg.nlmsg_len - sizeof(nlmsghdr);
+
+  const char *end = (const char*)nh + nh->nlmsg_len;
+  const char *p = (const char*)err + off;
+  while(p + sizeof(nlattr) <= end)
+  {
+    const nlattr *a = (const nlattr*)p;
+    if(a->nla_len < sizeof(nlattr) || p + a->nla_len > end) break;
+    if(a->nla_type == NLMSGERR_ATTR_MSG)
+      return string{(const char*)a + NLA_HDRLEN};
+    p += NLA_ALIGN(a->nla_len);
+  }
+#else
+  (void)nh;
+#endif
+  return "";
+}
 
+void NetLink::acks(uint32_t first, uint32_t last, 
+    function<void(uint32_t, int)> f)
+{
+  size_t pending = last - first + 1;
+  vector<char> buf(8192);
+
+  while(pending > 0)
+  {
+    //an ack that echoes a long request can be bigger than the buffer, size
+    //it from the datagram so nothing is cut off
+    ssize_t len = recv(sock(), nullptr, 0, MSG_PEEK | MSG_TRUNC);
+    if(len >= 0)
+    {
+      if(size_t(len) > buf.size()) buf.resize(len);
+      len = recv(sock(), buf.data(), buf.size(), 0);
+    }
+    if(len < 0)
+    {
+      if(errno == EINTR) continue;
+      string err = fmt::format("netlink recv failed: {}", strerror(errno));
+      LOG(ERROR) << err;
+      throw runtime_error{err};
+    }
+
+    size_t rlen = len;
+    for(nlmsghdr *nh=(nlmsghdr*)buf.data(); NLMSG_OK(nh, rlen); 
+        nh=NLMSG_NEXT(nh, rlen))
+    {
+      if(nh->nlmsg_seq < first || nh->nlmsg_seq > last) continue;
+      if(nh->nlmsg_type != NLMSG_ERROR) continue;
+
+      nlmsgerr *err = (nlmsgerr*)NLMSG_DATA(nh);
+      if(err->error != 0)
+      {
+        string why = extAck(nh);
+        if(!why.empty())
+          LOG(WARNING) << "netlink request " << nh->nlmsg_seq << ": " << why;
+      }
+      f(nh->nlmsg_seq, err->error);
+      --pending;
+    }
+  }
+}
+
+void NetLink::setLink(string ifx, Request rq)
+{
+  auto errors = setLinks({{ifx, rq}});
+  if(!errors.empty())
+  {
+    string err = fmt::format("{}: {}", ifx, errors.begin()->second);
+    LOG(ERROR) << "setLink " << err;
+    throw runtime_error{err};
+  }
+}
+
+/*
+ * All of the requests are packed back to back into one buffer and go to the
+ * kernel in a single sendmsg, it processes them in order and we collect the
+ * acks in one receive loop.
+ */
+map<string, string> NetLink::setLinks(const vector<pair<string, Request>> & rqs)
+{
+  map<string, string> errors;
+  if(rqs.empty()) return errors;
+
+  lock_guard<mutex> lk{mtx_};
+
+  static_assert(sizeof(Request) == NLMSG_SPACE(sizeof(ifinfomsg)),
+      "requests must pack back to back as netlink messages");
+
+  uint32_t first = seq_ + 1;
+  vector<Request> buf;
+  buf.reserve(rqs.size());
+  for(const auto & r : rqs)
+  {
+    Request rq = r.second;
+    rq.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    rq.header.nlmsg_seq = ++seq_;
+    buf.push_back(rq);
+  }
+
+  send(buf.data(), buf.size() * sizeof(Request));
+  acks(first, seq_, [&](uint32_t seq, int error)
+  {
+    if(error != 0) errors[rqs[seq - first].first] = strerror(-error);
+  });
+
+  return errors;
+}
+
+uint32_t NetLink::tx(Request req)
+{
+  req.header.nlmsg_seq = ++seq_;
+  send(&req, req.header.nlmsg_len);
+  return req.header.nlmsg_seq;
+}
+
+NetLink::Response NetLink::rx(uint32_t seq)
+{
+  int fd = sock();
+
+  //start out as big as the biggest dump so far, on a steady switch that means
+  //a single allocation for the buffer and one for the messages
   NetLink::Response rs;
-  rs.fd = fd;
+  rs.reserve(rxBytes_);
+  rs.messages.reserve(rxMessages_);
+
   bool over{false};
   while(!over)
   {
-    memset(buf, 0, 16192);
-    iovec iov = {buf, 16192};
-    msghdr msg = {&sa, sizeof(sa), &iov, 1, nullptr, 0, 0};
-
-    size_t len = recvmsg(fd, &msg, 0);
-
-    rs.data = (char*)realloc(rs.data, rxd+len);
-    memcpy(&rs.data[rxd], buf, len);
-    char *bp = &rs.data[rxd];
-    rxd += len;
+    //find out how big the next datagram is before taking it off the socket so
+    //it can be received straight into the response buffer
+    ssize_t rc = recv(fd, nullptr, 0, MSG_PEEK | MSG_TRUNC);
+    if(rc >= 0)
+    {
+      size_t need = rs.size + rc;
+      if(need > rs.capacity) rs.reserve(std::max(need, 2*rs.capacity));
+      rc = recv(fd, &rs.data[rs.size], rs.capacity - rs.size, 0);
+    }
+    if(rc < 0)
+    {
+      if(errno == EINTR) continue;
+      string err = fmt::format("netlink recv failed: {}", strerror(errno));
+      LOG(ERROR) << err;
+      throw runtime_error{err};
+    }
+    size_t len = rc;
+    nlmsghdr *nh = (nlmsghdr*)&rs.data[rs.size];
+    rs.size += len;
 
-    for(nlmsghdr *nh=(nlmsghdr*)bp; NLMSG_OK(nh, len); nh=NLMSG_NEXT(nh, len))
+    for(; NLMSG_OK(nh, len); nh=NLMSG_NEXT(nh, len))
     {
-      if(nh->nlmsg_type == NLMSG_DONE) 
+      if(nh->nlmsg_seq != seq) continue;
+      if(nh->nlmsg_type == NLMSG_DONE || nh->nlmsg_type == NLMSG_ERROR) 
       {
         over = true;
         break;
       }
+      if(nh->nlmsg_type != RTM_BASE) continue;
+
+      ifinfomsg *msg = (ifinfomsg*)NLMSG_DATA(nh);
+      if(msg->ifi_type != ARPHRD_ETHER) continue;
+
+      rs.messages.push_back(message(nh));
     }
   }
 
-  for(nlmsghdr *nh = (nlmsghdr*)rs.data; 
-      NLMSG_OK(nh, rxd); 
-      nh = NLMSG_NEXT(nh, rxd)
-  )
+  rxBytes_ = std::max(rxBytes_, rs.size);
+  rxMessages_ = std::max(rxMessages_, rs.messages.size());
+  return rs;
+}
+
+void NetLink::Response::reserve(size_t n)
+{
+  if(n <= capacity) return;
+
+  std::unique_ptr<char[]> grown{new char[n]};
+  if(size > 0) memcpy(grown.get(), data.get(), size);
+
+  //messages already parsed point into the old buffer, carry them over
+  auto rebase = [&](void *p){ 
+    return grown.get() + ((char*)p - data.get()); 
+  };
+  for(auto & m : messages)
+  {
+    m.header = (nlmsghdr*)rebase(m.header);
+    for(auto & a : m.attributes) if(a != nullptr) a = (rtattr*)rebase(a);
+  }
+
+  data = std::move(grown);
+  capacity = n;
+}
+
+NetLink::Response::Message NetLink::message(nlmsghdr *nh)
+{
+  NetLink::Response::Message m;
+  m.header = nh;
+  m.attributes.fill(nullptr);
+
+  ifinfomsg *msg = (ifinfomsg*)NLMSG_DATA(nh);
+  rtattr *rta = IFLA_RTA(msg);
+  int alen = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*msg));
+
+  for(; RTA_OK(rta, alen); rta = RTA_NEXT(rta, alen)) 
   {
-    NetLink::Response::Message m;
-    m.header = nh;
+    unsigned short type = rta->rta_type & NLA_TYPE_MASK;
+    if(type <= IFLA_MAX) m.attributes[type] = rta;
+  }
 
-    if(nh->nlmsg_type != RTM_BASE) continue;
+  return m;
+}
 
-    ifinfomsg *msg = (ifinfomsg*)NLMSG_DATA(nh);
-    if(msg->ifi_type != ARPHRD_ETHER) continue;
+template <>
+Mac deter::getAttr<Mac>(const rtattr *a)
+{
+  Mac m;
+  memcpy(m.octets.data(), RTA_DATA(a), 
+      std::min(m.octets.size(), (size_t)RTA_PAYLOAD(a)));
+  return m;
+}
 
-    rtattr *rta = IFLA_RTA(msg);
-    int alen = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*msg));
+string Mac::str() const
+{
+  return fmt::format("{:02x}:{:02x}:{:02x}:{:02x}:{:02x}:{:02x}",
+      octets[0], octets[1], octets[2], octets[3], octets[4], octets[5]);
+}
 
-    for(; RTA_OK(rta, alen); rta = RTA_NEXT(rta, alen)) 
-      m.attributes.push_back(rta);
+template <>
+Attributes deter::getAttr<Attributes>(const rtattr *a)
+{
+  Attributes as;
+  const rtattr *rta = (const rtattr*)RTA_DATA(a);
+  int alen = RTA_PAYLOAD(a);
 
-    rs.messages.push_back(m);
+  for(; RTA_OK(rta, alen); rta = RTA_NEXT(rta, alen)) 
+  {
+    unsigned short type = rta->rta_type & NLA_TYPE_MASK;
+    if(type >= as.table.size()) as.table.resize(type+1, nullptr);
+    as.table[type] = rta;
   }
 
-  return rs;
+  return as;
+}
+
+template <>
+rtnl_link_stats64 deter::getAttr<rtnl_link_stats64>(const rtattr *a)
+{
+  rtnl_link_stats64 s{};
+  memcpy(&s, RTA_DATA(a), std::min(sizeof(s), (size_t)RTA_PAYLOAD(a)));
+  return s;
 }
 
 ifinfomsg* NetLink::Response::Message::ifInfo() const
@@ -119,142 +402,422 @@ ifinfomsg* NetLink::Response::Message::ifInfo() const
 
 NetLink::Response NetLink::getLink()
 {
+  lock_guard<mutex> lk{mtx_};
   return rx(tx());
 }
 
-NetLink::Response::~Response()
+vector<NetLink::LinkStats> NetLink::stats()
 {
-  free(data);
+  auto rs = getLink();
+
+  vector<LinkStats> ss;
+  ss.reserve(rs.messages.size());
+  for(const auto & m : rs.messages)
+  {
+    ss.push_back({
+        m.getAttribute<string>(IFLA_IFNAME),
+        m.getAttribute<rtnl_link_stats64>(IFLA_STATS64)
+    });
+  }
+  return ss;
 }
 
-size_t NetLink::linkSpeed(string ifx)
+static bool ethtoolGet(int sock, const string & ifx, ethtool_cmd & edata)
 {
   struct ifreq ifr;
-  struct ethtool_cmd edata;
   
   memset(ifr.ifr_name, 0, sizeof(ifr.ifr_name));
-  strncpy(ifr.ifr_name, ifx.c_str(), ifx.length());
+  strncpy(ifr.ifr_name, ifx.c_str(), sizeof(ifr.ifr_name) - 1);
   ifr.ifr_data = (char*)&edata;
   edata.cmd = ETHTOOL_GSET;
 
-  int rc = ioctl(testSock(), SIOCETHTOOL, &ifr);
-  if(rc < 0) {
+  return ioctl(sock, SIOCETHTOOL, &ifr) >= 0;
+}
+
+size_t NetLink::linkSpeed(string ifx)
+{
+  struct ethtool_cmd edata;
+  if(!ethtoolGet(testSock(), ifx, edata)) {
     string msg = fmt::format("fail to ioctl ethtool for {}", ifx);
     LOG(ERROR) << msg;
     throw runtime_error{msg};
   }
   
-  int spd = ethtool_cmd_speed(&edata);
+  uint32_t spd = ethtool_cmd_speed(&edata);
+  if(spd == (uint32_t)SPEED_UNKNOWN) return 0;
+  return spd;
+}
 
-  switch (spd) {
-    case (__u32)SPEED_UNKNOWN: return 0;
-    default: return spd;
+static NetLink::LinkMode readLinkMode(int sock, const string & ifx)
+{
+  NetLink::LinkMode lm;
+  struct ethtool_cmd edata;
+  if(!ethtoolGet(sock, ifx, edata)) return lm;
+
+  uint32_t spd = ethtool_cmd_speed(&edata);
+  lm.speed = spd == (uint32_t)SPEED_UNKNOWN ? 0 : spd;
+  switch(edata.duplex)
+  {
+    case DUPLEX_HALF: lm.duplex = "half"; break;
+    case DUPLEX_FULL: lm.duplex = "full"; break;
+    default: break;
   }
+  return lm;
 }
 
-size_t NetLink::capSpeed(string ifx)
+NetLink::LinkMode NetLink::linkMode(string ifx)
 {
-  ethtool_modinfo minfo;
-  memset(&minfo, 0, sizeof(minfo));
-  minfo.cmd = ETHTOOL_GMODULEINFO;
+  return readLinkMode(testSock(), ifx);
+}
 
-  ifreq ifr;
-  memset(&ifr, 0, sizeof(ifr));
-  strcpy(ifr.ifr_name, ifx.c_str());
-  ifr.ifr_data = (char*)&minfo;
+/*
+ * Link mode probers are started as linkModes first needs them and kept for
+ * the life of the process, so a carrier change or resync does not pay for
+ * creating threads and sockets every time. What they wait on is never 
+ * destroyed, they are still waiting on it at exit.
+ */
+struct NetLink::Probers
+{
+  mutex mtx;
+  std::condition_variable cv;
+  std::deque<function<void(int)>> queue;
+  size_t threads{0};
+};
 
+NetLink::Probers & NetLink::probers()
+{
+  static Probers *ps = new Probers;
+  return *ps;
+}
+
+/*
+ * SIOCETHTOOL goes all the way to the driver and on a breakout heavy switch 
+ * that adds up over a hundred ports. The ioctls for different ports don't
+ * wait on each other, so the list is split between the caller and a few 
+ * probers, each with its own socket, that pull ports off a shared counter.
+ * With the monitor running listings are served from the link table and
+ * only resync and carrier changes probe, this is what keeps those short.
+ */
+vector<NetLink::LinkMode> 
+NetLink::linkModes(const vector<string> & ifxs, size_t threads)
+{
+  vector<LinkMode> modes(ifxs.size());
+  if(ifxs.empty()) return modes;
 
-  int err = ioctl(testSock(), SIOCETHTOOL, &ifr);
+  //a thread per 16 ports, no more than 8
+  if(threads == 0) threads = std::min<size_t>(ifxs.size() / 16 + 1, 8);
+  threads = std::max<size_t>(1, std::min(threads, ifxs.size()));
 
-  //this is not a module device
-  if(err < 0) 
+  std::atomic<size_t> next{0};
+  auto work = [&](int sock)
   {
-    LOG(ERROR) << "err: SIOCETHTOOL " << err;
-    return 0; 
+    for(size_t i = next++; i < ifxs.size(); i = next++)
+      modes[i] = readLinkMode(sock, ifxs[i]);
+  };
+
+  if(threads == 1)
+  {
+    work(testSock());
+    return modes;
   }
 
+  //the caller is one of the threads, the probers the rest
+  size_t left = threads - 1;
+  mutex doneMtx;
+  std::condition_variable doneCv;
+  Probers & ps = probers();
+  {
+    lock_guard<mutex> lk{ps.mtx};
+    for(; ps.threads < left; ++ps.threads) thread{prober}.detach();
+    for(size_t t=0; t<left; ++t)
+    {
+      ps.queue.push_back([&](int sock)
+      {
+        work(sock);
+        lock_guard<mutex> dlk{doneMtx};
+        if(--left == 0) doneCv.notify_one();
+      });
+    }
+  }
+  ps.cv.notify_all();
 
-  ethtool_eeprom* einfo = 
-    (ethtool_eeprom*)malloc(sizeof(ethtool_eeprom) + minfo.eeprom_len);
-  memset(einfo, 0, sizeof(ethtool_eeprom) + minfo.eeprom_len);
-  einfo->cmd = ETHTOOL_GMODULEEEPROM;
-  einfo->len = minfo.eeprom_len;
-  ifr.ifr_data = (char*)einfo;
-  
-  err = ioctl(testSock(), SIOCETHTOOL, &ifr);
-  if(err < 0) throw runtime_error{"ioctl::ETHTOOL_GMODULEEEPROM failed"};
+  work(testSock());
 
-  unsigned char* eeprom_data = (unsigned char*)einfo->data;
+  //everything may be probed already, but the tasks refer to this frame
+  std::unique_lock<mutex> lk{doneMtx};
+  doneCv.wait(lk, [&]{ return left == 0; });
 
-  unsigned short module_id = (unsigned short)eeprom_data[128];
+  return modes;
+}
 
-  if(module_id == 0x0d)
-  {
-    LOG(INFO) << ifx << ": qsfp+ module detected";
-  }
-  else if(module_id == 0x11)
+void NetLink::prober()
+{
+  int sock = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_IP);
+  if(sock < 0)
   {
-    LOG(INFO) << ifx << ": qsfp28 module detected";
+    LOG(ERROR) << "failed to get ethtool socket: " << strerror(errno);
+    sock = testSock();
   }
-  else if(module_id == 0)
+
+  for(;;)
   {
-    LOG(WARNING) << ifx << ": module not detected";
-    return 0;
+    function<void(int)> task;
+    {
+      Probers & ps = probers();
+      std::unique_lock<mutex> lk{ps.mtx};
+      ps.cv.wait(lk, [&]{ return !ps.queue.empty(); });
+      task = std::move(ps.queue.front());
+      ps.queue.pop_front();
+    }
+    task(sock);
   }
-  else
+}
+
+size_t NetLink::capSpeed(string ifx)
+{
+  return transceiver(ifx).capSpeed;
+}
+
+//asks the driver about the module, fails when there is nothing plugged in or
+//the port can't take one
+static bool moduleInfo(int sock, const string & ifx, ethtool_modinfo & minfo)
+{
+  memset(&minfo, 0, sizeof(minfo));
+  minfo.cmd = ETHTOOL_GMODULEINFO;
+
+  ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, ifx.c_str(), IFNAMSIZ-1);
+  ifr.ifr_data = (char*)&minfo;
+
+  return ioctl(sock, SIOCETHTOOL, &ifr) == 0 && minfo.eeprom_len > 0;
+}
+
+/*
+ * Transceiver decoding
+ *
+ * QSFP modules (SFF-8436/8636) carry the identifier at byte 128 of the upper
+ * page and the 10/40G compliance codes at byte 131, bit 7 of which says to
+ * look at the extended compliance code (SFF-8024) at byte 192 where the 100G
+ * and 25G media live. SFP modules (SFF-8472) have the identifier at byte 0,
+ * 10G codes at byte 3 and the extended code at byte 36.
+ */
+
+/*
+ * Most of the SFF-8024 extended codes name a 100G four lane medium and its
+ * 25G single lane counterpart at once, "100GBASE-SR4 or 25GBASE-SR", which
+ * one is meant depends on the module. sfp picks the single lane reading.
+ */
+static const char* extendedCompliance(uint8_t code, bool sfp, size_t & speed)
+{
+  static const struct
   {
-    LOG(WARNING) << ifx << ": unknown module id " << std::hex << module_id;
-    return 0;
+    uint8_t code;
+    const char *quad;
+    size_t quadSpeed;
+    const char *single;
   }
+  codes[] = {
+    {0x01, "100G AOC", 100000, "25G AOC"},
+    {0x02, "100GBASE-SR4", 100000, "25GBASE-SR"},
+    {0x03, "100GBASE-LR4", 100000, "25GBASE-LR"},
+    {0x04, "100GBASE-ER4", 100000, "25GBASE-ER"},
+    {0x05, "100GBASE-SR10", 100000, nullptr},
+    {0x06, "100G CWDM4", 100000, nullptr},
+    {0x07, "100G PSM4", 100000, nullptr},
+    {0x08, "100G ACC", 100000, "25G ACC"},
+    {0x0b, "100GBASE-CR4", 100000, "25GBASE-CR CA-L"},
+    {0x0c, "25GBASE-CR CA-S", 25000, "25GBASE-CR CA-S"},
+    {0x0d, "25GBASE-CR CA-N", 25000, "25GBASE-CR CA-N"},
+    {0x18, "100G AOC", 100000, "25G AOC"},
+    {0x19, "100G ACC", 100000, "25G ACC"}
+  };
 
-  auto tcode = std::bitset<8>(eeprom_data[131]);
-  if(tcode.test(0))
+  speed = 0;
+  for(const auto & c : codes)
   {
-    LOG(INFO) << ifx << ": 40G Active transceiver detected";
-    return 40000;
+    if(c.code != code) continue;
+    if(!sfp)
+    {
+      speed = c.quadSpeed;
+      return c.quad;
+    }
+    if(c.single == nullptr) break;
+    speed = 25000;
+    return c.single;
   }
-  
-  if(tcode.test(1))
+  return "";
+}
+
+//vendor name and serial number are space padded ascii
+static string eepromText(const uint8_t *ee, size_t at, size_t len)
+{
+  string s{(const char*)ee + at, len};
+  s.erase(s.find_last_not_of(string{" \0", 2}) + 1);
+  return s;
+}
+
+static void decodeQsfp(const uint8_t *ee, size_t len, NetLink::Transceiver & t)
+{
+  if(len < 212) return;
+  t.id = ee[128];
+
+  switch(t.id)
   {
-    LOG(INFO) << ifx << ": 40G LR4 transceiver detected";
-    return 40000;
+    case 0x0c: t.module = "qsfp"; break;
+    case 0x0d: t.module = "qsfp+"; break;
+    case 0x11: t.module = "qsfp28"; break;
+    default: return;
   }
-  
-  if(tcode.test(2))
+  t.vendor = eepromText(ee, 148, 16);
+  t.serial = eepromText(ee, 196, 16);
+
+  auto tcode = std::bitset<8>(ee[131]);
+  if(tcode.test(7))
   {
-    LOG(INFO) << ifx << ": 40G SR4 transceiver detected";
-    return 40000;
+    t.media = extendedCompliance(ee[192], false, t.capSpeed);
+    if(t.capSpeed) return;
   }
-  
-  if(tcode.test(3))
+
+  static const pair<const char*, size_t> codes[] = {
+    {"40G Active", 40000},
+    {"40GBASE-LR4", 40000},
+    {"40GBASE-SR4", 40000},
+    {"40GBASE-CR4", 40000},
+    {"10GBASE-SR", 10000},
+    {"10GBASE-LR", 10000},
+    {"10GBASE-LRM", 10000}
+  };
+  for(size_t i=0; i<7; ++i)
   {
-    LOG(INFO) << ifx << ": 40G CR4 transceiver detected";
-    return 40000;
+    if(!tcode.test(i)) continue;
+    t.media = codes[i].first;
+    t.capSpeed = codes[i].second;
+    return;
   }
 
-  if(tcode.test(4))
+  //no code we know, the identifier still says what the cage can do
+  if(t.id == 0x11) t.capSpeed = 100000;
+  else t.capSpeed = 40000;
+}
+
+static void decodeSfp(const uint8_t *ee, size_t len, NetLink::Transceiver & t)
+{
+  if(len < 84) return;
+  t.id = ee[0];
+  if(t.id != 0x03) return;
+  t.module = "sfp";
+  t.vendor = eepromText(ee, 20, 16);
+  t.serial = eepromText(ee, 68, 16);
+
+  t.media = extendedCompliance(ee[36], true, t.capSpeed);
+  if(t.capSpeed) 
   {
-    LOG(INFO) << ifx << ": 10G SR transceiver detected";
-    return 10000;
+    t.module = "sfp28";
+    return;
   }
 
-  if(tcode.test(5))
+  auto tcode = std::bitset<8>(ee[3]);
+  static const char* codes[] = {
+    "10GBASE-SR", "10GBASE-LR", "10GBASE-LRM", "10GBASE-ER"
+  };
+  for(size_t i=4; i<8; ++i)
   {
-    LOG(INFO) << ifx << ": 10G LR transceiver detected";
-    return 10000;
+    if(!tcode.test(i)) continue;
+    t.media = codes[i-4];
+    t.capSpeed = 10000;
+    return;
   }
+}
 
-  if(tcode.test(6))
+NetLink::Transceiver
+NetLink::decodeModule(uint32_t type, const uint8_t *ee, size_t len)
+{
+  Transceiver t;
+  switch(type)
   {
-    LOG(INFO) << ifx << ": 10G LRM transceiver detected";
-    return 10000;
+    case ETH_MODULE_SFF_8436:
+    case ETH_MODULE_SFF_8636:
+      decodeQsfp(ee, len, t);
+      break;
+    default:
+      decodeSfp(ee, len, t);
   }
+  return t;
+}
+
+//len bytes of the module eeprom from offset on, the rest of ee left zero
+static void readEeprom(int sock, const string & ifx, 
+    const ethtool_modinfo & minfo, uint32_t offset, uint32_t len, 
+    vector<uint8_t> & ee)
+{
+  vector<uint8_t> buf(sizeof(ethtool_eeprom) + len, 0);
+  ethtool_eeprom *einfo = (ethtool_eeprom*)buf.data();
+  einfo->cmd = ETHTOOL_GMODULEEEPROM;
+  einfo->offset = offset;
+  einfo->len = len;
+
+  ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, ifx.c_str(), IFNAMSIZ-1);
+  ifr.ifr_data = (char*)einfo;
+  
+  if(ioctl(sock, SIOCETHTOOL, &ifr) < 0) 
+    throw runtime_error{"ioctl::ETHTOOL_GMODULEEEPROM failed"};
 
-  return 0;
+  ee.assign(minfo.eeprom_len, 0);
+  std::copy(einfo->data, einfo->data + len, ee.begin() + offset);
+}
+
+NetLink::Transceiver NetLink::transceiver(string ifx)
+{
+  Transceiver t;
+
+  ethtool_modinfo minfo;
+  if(!moduleInfo(testSock(), ifx, minfo)) return t;
+
+  vector<uint8_t> ee;
+  readEeprom(testSock(), ifx, minfo, 0, minfo.eeprom_len, ee);
+  t = decodeModule(minfo.type, ee.data(), ee.size());
+
+  if(t.capSpeed)
+    LOG(INFO) << ifx << ": " << t.module << " " << t.media << " detected";
+  else if(t.id == 0)
+    LOG(WARNING) << ifx << ": module not detected";
+  else
+    LOG(WARNING) << ifx << ": unknown module id " << std::hex << (int)t.id;
+
+  return t;
+}
+
+/*
+ * Only the identifier, vendor name and serial number, the bytes up to the
+ * end of the serial number are a third of the eeprom or less. Everything 
+ * else decodes as if zero.
+ */
+static NetLink::Transceiver 
+moduleIdentity(int sock, const string & ifx, const ethtool_modinfo & minfo)
+{
+  bool qsfp = 
+    minfo.type == ETH_MODULE_SFF_8436 || minfo.type == ETH_MODULE_SFF_8636;
+  uint32_t offset = qsfp ? 128 : 0;
+  uint32_t end = qsfp ? 212 : 84;
+  if(minfo.eeprom_len < end) return NetLink::Transceiver{};
+
+  vector<uint8_t> ee;
+  readEeprom(sock, ifx, minfo, offset, end - offset, ee);
+  return NetLink::decodeModule(minfo.type, ee.data(), ee.size());
 }
 
 size_t NetLink::ifxIndex(string ifx)
 {
+  {
+    lock_guard<mutex> lk{linkMtx_};
+    auto i = indexes_.find(ifx);
+    if(i != indexes_.end()) return i->second;
+  }
+
+  //not something the monitor has seen (or it is not running), ask the kernel
   struct ifreq ifr;
   memset(ifr.ifr_name, 0, sizeof(ifr.ifr_name));
   strncpy(ifr.ifr_name, ifx.c_str(), ifx.length());
@@ -265,24 +828,41 @@ size_t NetLink::ifxIndex(string ifx)
   return ifr.ifr_ifindex;
 }
 
-//TODO check netlink response? fire and forget for now
-void NetLink::enableIfx(string ifx)
+//only IFF_UP is in the change mask so the other flags are left alone
+static NetLink::Request upRequest(size_t index, bool up)
 {
-  Request rq;
+  NetLink::Request rq;
   rq.header.nlmsg_type = RTM_SETLINK;
-  rq.msg.ifi_index = ifxIndex(ifx);
-  rq.msg.ifi_flags |= IFF_UP;
-  tx(rq);
+  rq.msg.ifi_index = index;
+  rq.msg.ifi_flags = up ? IFF_UP : 0;
+  rq.msg.ifi_change = IFF_UP;
+  return rq;
+}
+
+void NetLink::enableIfx(string ifx)
+{
+  setLink(ifx, upRequest(ifxIndex(ifx), true));
 }
 
-//TODO check netlink response? fire and forget for now
 void NetLink::disableIfx(string ifx)
 {
-  Request rq;
-  rq.header.nlmsg_type = RTM_SETLINK;
-  rq.msg.ifi_index = ifxIndex(ifx);
-  rq.msg.ifi_flags &= ~(IFF_UP | IFF_LOWER_UP);
-  tx(rq);
+  setLink(ifx, upRequest(ifxIndex(ifx), false));
+}
+
+map<string, string> NetLink::setIfxsUp(const vector<string> & ifxs, bool up)
+{
+  map<string, string> errors;
+  vector<pair<string, Request>> rqs;
+  rqs.reserve(ifxs.size());
+  for(const string & ifx : ifxs)
+  {
+    try { rqs.push_back({ifx, upRequest(ifxIndex(ifx), up)}); }
+    catch(runtime_error &e) { errors[ifx] = e.what(); }
+  }
+
+  auto nacked = setLinks(rqs);
+  errors.insert(nacked.begin(), nacked.end());
+  return errors;
 }
 
 //TODO this really does nothing at the end of the day, cumulus does not have 
@@ -341,3 +921,505 @@ void NetLink::setIfxDuplex(string ifx, int duplex)
   edata.duplex = duplex;
   ioctl(testSock(), SIOCETHTOOL, &ifr);
 }
+
+/*
+ * Bridge vlans
+ *
+ * Each port gets at most one RTM_DELLINK and one RTM_SETLINK carrying all of
+ * its vlans as IFLA_BRIDGE_VLAN_INFO attributes under IFLA_AF_SPEC. All of
+ * the messages go out in one sendmsg and every one is acked.
+ */
+
+static void addAttr(vector<char> & buf, size_t msg, int type, 
+    const void *data, size_t len)
+{
+  size_t at = buf.size();
+  buf.resize(at + RTA_SPACE(len));
+  rtattr *rta = (rtattr*)&buf[at];
+  rta->rta_type = type;
+  rta->rta_len = RTA_LENGTH(len);
+  memcpy(RTA_DATA(rta), data, len);
+  ((nlmsghdr*)&buf[msg])->nlmsg_len = buf.size() - msg;
+}
+
+static void addVlanMessage(vector<char> & buf, int type, uint32_t seq,
+    int index, bool self, const vector<bridge_vlan_info> & vlans)
+{
+  size_t msg = buf.size();
+  buf.resize(msg + NLMSG_SPACE(sizeof(ifinfomsg)));
+
+  nlmsghdr *nh = (nlmsghdr*)&buf[msg];
+  nh->nlmsg_len = NLMSG_LENGTH(sizeof(ifinfomsg));
+  nh->nlmsg_type = type;
+  nh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+  nh->nlmsg_seq = seq;
+
+  ifinfomsg *ifi = (ifinfomsg*)NLMSG_DATA(nh);
+  ifi->ifi_family = AF_BRIDGE;
+  ifi->ifi_index = index;
+
+  size_t nest = buf.size();
+  addAttr(buf, msg, IFLA_AF_SPEC | NLA_F_NESTED, nullptr, 0);
+
+  if(self)
+  {
+    uint16_t flags = BRIDGE_FLAGS_SELF;
+    addAttr(buf, msg, IFLA_BRIDGE_FLAGS, &flags, sizeof(flags));
+  }
+  for(const auto & v : vlans)
+  {
+    addAttr(buf, msg, IFLA_BRIDGE_VLAN_INFO, &v, sizeof(v));
+  }
+
+  ((rtattr*)&buf[nest])->rta_len = buf.size() - nest;
+}
+
+vector<string> NetLink::setBridgeVlans(
+    const vector<BridgeVlan> & add, const vector<BridgeVlan> & del)
+{
+  //(message type, ifx) -> vlans, the bridge itself sorts after its ports
+  //for removals and before them for additions
+  map<pair<int, string>, vector<bridge_vlan_info>> msgs;
+  auto collect = [&msgs](int type, const vector<BridgeVlan> & vs)
+  {
+    for(const auto & v : vs)
+    {
+      bridge_vlan_info vi;
+      vi.vid = v.vid;
+      vi.flags = v.pvid ? 
+        (BRIDGE_VLAN_INFO_PVID | BRIDGE_VLAN_INFO_UNTAGGED) : 0;
+      msgs[{type, v.ifx}].push_back(vi);
+    }
+  };
+  collect(RTM_DELLINK, del);
+  collect(RTM_SETLINK, add);
+
+  vector<string> failed;
+  if(msgs.empty()) return failed;
+
+  lock_guard<mutex> lk{mtx_};
+
+  vector<char> buf;
+  vector<string> bySeq;
+  uint32_t first = seq_ + 1;
+  auto build = [&](int type, bool bridge)
+  {
+    for(const auto & m : msgs)
+    {
+      if(m.first.first != type || (m.first.second == "bridge") != bridge)
+        continue;
+
+      int index;
+      try { index = ifxIndex(m.first.second); }
+      catch(runtime_error &) 
+      { 
+        failed.push_back(m.first.second); 
+        continue; 
+      }
+
+      bySeq.push_back(m.first.second);
+      addVlanMessage(buf, type, ++seq_, index, bridge, m.second);
+    }
+  };
+  build(RTM_DELLINK, false);
+  build(RTM_DELLINK, true);
+  build(RTM_SETLINK, true);
+  build(RTM_SETLINK, false);
+
+  if(bySeq.empty()) return failed;
+
+  set<string> nacked;
+  try
+  {
+    send(buf.data(), buf.size());
+    acks(first, seq_, [&](uint32_t seq, int error)
+    {
+      if(error == 0) return;
+      const string & ifx = bySeq[seq - first];
+      LOG(WARNING) << "setBridgeVlans: " << ifx << ": " << strerror(-error);
+      nacked.insert(ifx);
+    });
+  }
+  catch(runtime_error &)
+  {
+    //we have no idea what made it, let ifup sort it out
+    nacked.insert(bySeq.begin(), bySeq.end());
+  }
+
+  failed.insert(failed.end(), nacked.begin(), nacked.end());
+  return failed;
+}
+
+/*
+ * Link monitor
+ *
+ * The link table is seeded from one link dump and then kept current by a
+ * listener on the RTNLGRP_LINK multicast group, so renames, new breakout
+ * ports and link flaps show up without anyone asking the kernel. We 
+ * subscribe before the dump so nothing that happens in between is lost.
+ * Speed and duplex are not part of the netlink link messages, they are 
+ * probed with ethtool when a link shows up or its carrier changes.
+ */
+
+void NetLink::monitor(unsigned sweep)
+{
+  if(monSock_ >= 0) return;
+
+  //only the first of concurrent callers gets to start the monitor
+  int fd = monitorSocket(), none{-1};
+  if(!monSock_.compare_exchange_strong(none, fd))
+  {
+    close(fd);
+    return;
+  }
+
+  testSock();
+  resync();
+  LOG(INFO) << "link monitor started with " << indexes_.size() << " links";
+
+  thread{listen}.detach();
+  thread{inventory, sweep}.detach();
+}
+
+int NetLink::monitorSocket()
+{
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if(fd < 0) throw runtime_error{"failed to open netlink monitor socket"};
+
+  sockaddr_nl sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.nl_family = AF_NETLINK;
+  int group = RTNLGRP_LINK;
+  if(bind(fd, (sockaddr*)&sa, sizeof(sa)) < 0 || 
+     setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, 
+       &group, sizeof(group)) < 0)
+  {
+    close(fd);
+    throw runtime_error{"failed to subscribe to link notifications"};
+  }
+  return fd;
+}
+
+/*
+ * Transceiver inventory
+ *
+ * Reading a module eeprom takes long enough that it can't be done while 
+ * somebody waits on /listPorts, so a worker reads it once when a module 
+ * shows up and the result lives in the link table. Asking the driver whether
+ * a module is present is cheap, the worker does that for links the monitor
+ * saw appear or change carrier and for every link on a slow sweep, which 
+ * catches modules plugged into ports that stay down.
+ */
+
+void NetLink::inventory(unsigned sweep)
+{
+  for(;;)
+  {
+    vector<pair<int, string>> ls;
+    {
+      std::unique_lock<mutex> lk{invMtx_};
+      invCv_.wait_for(lk, std::chrono::seconds(sweep), 
+          []{ return !invQueue_.empty(); });
+      ls.swap(invQueue_);
+    }
+
+    if(ls.empty())
+    {
+      lock_guard<mutex> lk{linkMtx_};
+      for(const auto & l : links_) ls.push_back({l.first, l.second.name});
+    }
+
+    checkModules(ls);
+  }
+}
+
+void NetLink::checkModules(const vector<pair<int, string>> & ls)
+{
+  for(const auto & l : ls)
+  {
+    ethtool_modinfo minfo;
+    bool present = moduleInfo(testSock(), l.second, minfo);
+
+    Transceiver was;
+    {
+      lock_guard<mutex> lk{linkMtx_};
+      auto i = links_.find(l.first);
+      if(i == links_.end()) continue;
+      was = i->second.module;
+    }
+    bool known = was.id != 0;
+
+    //a module swapped between two sweeps is present on both, tell them apart
+    //by vendor and serial number rather than reading it all every time
+    if(present && known)
+    {
+      Transceiver now;
+      try { now = moduleIdentity(testSock(), l.second, minfo); }
+      catch(runtime_error &e)
+      {
+        LOG(ERROR) << l.second << ": " << e.what();
+        continue;
+      }
+      if(now.vendor == was.vendor && now.serial == was.serial) continue;
+      LOG(INFO) << l.second << ": module replaced by " << now.vendor << " " 
+                << now.serial;
+    }
+    else if(present == known) continue;
+
+    Transceiver t;
+    if(present)
+    {
+      try { t = transceiver(l.second); }
+      catch(runtime_error &e)
+      {
+        //leave it unknown, the next sweep tries again
+        LOG(ERROR) << l.second << ": " << e.what();
+        continue;
+      }
+
+      //a module that can't be decoded still counts as seen so it is not 
+      //read over and over, it gets another look when it is pulled
+      if(t.id == 0) t.id = 0xff;
+    }
+    else LOG(INFO) << l.second << ": module removed";
+
+    lock_guard<mutex> lk{linkMtx_};
+    auto i = links_.find(l.first);
+    if(i == links_.end() || i->second.name != l.second) continue;
+    i->second.module = t;
+    ++generation_;
+  }
+}
+
+string NetLink::ifxName(int index)
+{
+  lock_guard<mutex> lk{linkMtx_};
+  auto i = links_.find(index);
+  if(i == links_.end()) return "";
+  return i->second.name;
+}
+
+NetLink::Link NetLink::link(const Response::Message & m)
+{
+  Link l;
+  l.index = m.ifInfo()->ifi_index;
+  l.flags = m.ifInfo()->ifi_flags;
+  l.name = m.getAttribute<string>(IFLA_IFNAME);
+
+  l.operstate = m.getAttribute<uint8_t>(IFLA_OPERSTATE);
+  l.mtu = m.getAttribute<uint32_t>(IFLA_MTU);
+  l.master = m.getAttribute<uint32_t>(IFLA_MASTER);
+  l.kind = 
+    m.getAttribute<Attributes>(IFLA_LINKINFO).get<string>(IFLA_INFO_KIND);
+  if(m.attributes[IFLA_ADDRESS]) 
+    l.mac = m.getAttribute<Mac>(IFLA_ADDRESS).str();
+
+  return l;
+}
+
+vector<NetLink::Link> NetLink::links()
+{
+  vector<Link> ls;
+
+  if(monSock_ >= 0)
+  {
+    {
+      lock_guard<mutex> lk{linkMtx_};
+      ls.reserve(links_.size());
+      for(const auto & l : links_) ls.push_back(l.second);
+    }
+
+    //same order as a kernel dump
+    std::sort(ls.begin(), ls.end(), 
+        [](const Link & a, const Link & b){ return a.index < b.index; });
+    return ls;
+  }
+
+  //no monitor, go to the kernel
+  auto rs = getLink();
+  vector<string> names;
+  for(const auto & m : rs.messages)
+  {
+    ls.push_back(link(m));
+    names.push_back(ls.back().name);
+  }
+
+  auto modes = linkModes(names);
+  for(size_t i=0; i<ls.size(); ++i)
+  {
+    ls[i].speed = modes[i].speed;
+    ls[i].duplex = modes[i].duplex;
+  }
+  return ls;
+}
+
+uint64_t NetLink::generation()
+{
+  if(monSock_ < 0) return 0;
+  lock_guard<mutex> lk{linkMtx_};
+  return generation_;
+}
+
+void NetLink::resync()
+{
+  auto rs = getLink();
+
+  //speed and duplex are probed again, but the modules of links that are
+  //still there are kept rather than read off every eeprom once more
+  vector<pair<int, string>> stale;
+  {
+    lock_guard<mutex> lk{linkMtx_};
+    auto old = std::move(links_);
+    links_.clear();
+    indexes_.clear();
+    ++generation_;
+    for(const auto & m : rs.messages) 
+    {
+      if(!learn(m)) continue;
+
+      int index = m.ifInfo()->ifi_index;
+      Link & l = links_[index];
+      auto o = old.find(index);
+      if(o != old.end() && o->second.name == l.name)
+        l.module = o->second.module;
+      stale.push_back({index, l.name});
+    }
+  }
+  probe(stale);
+}
+
+//caller holds linkMtx_, returns true if the link is new or its carrier 
+//changed and the speed and duplex need to be probed again
+bool NetLink::learn(const Response::Message & m)
+{
+  Link l = link(m);
+  if(l.name.empty()) return false;
+
+  bool stale{true};
+  auto old = links_.find(l.index);
+  if(old != links_.end())
+  {
+    //a rename keeps the index
+    if(old->second.name != l.name) indexes_.erase(old->second.name);
+    else stale = ((old->second.flags ^ l.flags) & IFF_LOWER_UP) != 0;
+
+    l.speed = old->second.speed;
+    l.duplex = old->second.duplex;
+    l.module = old->second.module;
+  }
+
+  links_[l.index] = l;
+  indexes_[l.name] = l.index;
+  ++generation_;
+  return stale;
+}
+
+//caller holds linkMtx_
+void NetLink::forget(int index)
+{
+  auto i = links_.find(index);
+  if(i == links_.end()) return;
+  indexes_.erase(i->second.name);
+  links_.erase(i);
+  ++generation_;
+}
+
+//ethtool can take a while per port so this runs without holding linkMtx_
+void NetLink::probe(const vector<pair<int, string>> & ls)
+{
+  vector<string> names;
+  names.reserve(ls.size());
+  for(const auto & l : ls) names.push_back(l.second);
+  vector<LinkMode> modes = linkModes(names);
+
+  lock_guard<mutex> lk{linkMtx_};
+  for(size_t i=0; i<ls.size(); ++i)
+  {
+    auto l = links_.find(ls[i].first);
+    if(l == links_.end() || l->second.name != ls[i].second) continue;
+    l->second.speed = modes[i].speed;
+    l->second.duplex = modes[i].duplex;
+    ++generation_;
+  }
+
+  if(ls.empty()) return;
+  {
+    lock_guard<mutex> lk{invMtx_};
+    invQueue_.insert(invQueue_.end(), ls.begin(), ls.end());
+  }
+  invCv_.notify_one();
+}
+
+/*
+ * RTNLGRP_LINK also carries the AF_BRIDGE view of the bridge ports, an
+ * RTM_NEWLINK for every bridge vlan change, ours included, and an 
+ * RTM_DELLINK when a port leaves the bridge. Those say nothing about the 
+ * link itself and lack most of its attributes, only AF_UNSPEC messages are
+ * learned from.
+ */
+void NetLink::listen()
+{
+  vector<char> buf(32768);
+  auto backoff = std::chrono::milliseconds{100};
+  for(;;)
+  {
+    ssize_t len = recv(monSock_, buf.data(), buf.size(), 0);
+    if(len < 0)
+    {
+      if(errno == EINTR) continue;
+      if(errno == ENOBUFS)
+      {
+        //the kernel dropped notifications on us, start over
+        LOG(WARNING) << "link monitor overrun, resyncing";
+        try { resync(); }
+        catch(runtime_error &e) { LOG(ERROR) << "resync: " << e.what(); }
+        continue;
+      }
+
+      //anything else won't go away by asking again, wait a while and start
+      //over on a new socket
+      LOG(ERROR) << "link monitor recv failed: " << strerror(errno) 
+                 << ", reopening in " << backoff.count() << " ms";
+      std::this_thread::sleep_for(backoff);
+      backoff = std::min(backoff * 2, std::chrono::milliseconds{10000});
+      try 
+      { 
+        close(monSock_.exchange(monitorSocket()));
+        resync(); 
+      }
+      catch(runtime_error &e) { LOG(ERROR) << "link monitor: " << e.what(); }
+      continue;
+    }
+    backoff = std::chrono::milliseconds{100};
+
+    size_t rlen = len;
+    vector<pair<int, string>> stale;
+    {
+      lock_guard<mutex> lk{linkMtx_};
+      for(nlmsghdr *nh=(nlmsghdr*)buf.data(); NLMSG_OK(nh, rlen);
+          nh=NLMSG_NEXT(nh, rlen))
+      {
+        if(nh->nlmsg_type != RTM_NEWLINK && nh->nlmsg_type != RTM_DELLINK)
+          continue;
+
+        ifinfomsg *ifi = (ifinfomsg*)NLMSG_DATA(nh);
+        if(ifi->ifi_family != AF_UNSPEC) continue;
+        if(ifi->ifi_type != ARPHRD_ETHER) continue;
+
+        if(nh->nlmsg_type == RTM_DELLINK) 
+        {
+          forget(ifi->ifi_index);
+          continue;
+        }
+
+        auto m = message(nh);
+        if(learn(m)) 
+        {
+          stale.push_back(
+              {ifi->ifi_index, m.getAttribute<string>(IFLA_IFNAME)});
+        }
+      }
+    }
+    probe(stale);
+  }
+}
@@ -1,18 +1,28 @@
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <netinet/in.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 #include <linux/ethtool.h>
 #include <linux/sockios.h>
 #include <linux/if.h>
+#include <linux/if_ether.h>
 #include <net/if_arp.h>
 //#include <net/if.h>
-#include <netinet/in.h>
 #include <string.h>
 #include <unistd.h>
 #include <vector>
+#include <array>
+#include <memory>
+#include <algorithm>
 #include <string>
 #include <iostream>
+#include <functional>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <unordered_map>
 
 //Need these for some old-ish ethtool versions
 #ifndef SPEED_1000000
@@ -36,6 +46,58 @@ namespace deter
     return std::string((char*)RTA_DATA(a));
   }
 
+  template <>
+  inline
+  uint32_t getAttr<uint32_t>(const rtattr *a)
+  {
+    uint32_t x{0};
+    memcpy(&x, RTA_DATA(a), std::min(sizeof(x), (size_t)RTA_PAYLOAD(a)));
+    return x;
+  }
+
+  template <>
+  inline
+  uint8_t getAttr<uint8_t>(const rtattr *a)
+  {
+    return RTA_PAYLOAD(a) ? *(uint8_t*)RTA_DATA(a) : 0;
+  }
+
+  //hardware address as carried in IFLA_ADDRESS / IFLA_BROADCAST
+  struct Mac
+  {
+    std::array<uint8_t, ETH_ALEN> octets{};
+    std::string str() const;
+  };
+
+  template <>
+  Mac getAttr<Mac>(const rtattr *a);
+
+  //attributes nested inside another (IFLA_LINKINFO, IFLA_AF_SPEC, ...),
+  //indexed by type like the top level table of a message
+  struct Attributes
+  {
+    std::vector<const rtattr*> table;
+
+    const rtattr* operator[](int type) const
+    {
+      if(type < 0 || (size_t)type >= table.size()) return nullptr;
+      return table[type];
+    }
+
+    template <typename T> 
+    T get(int type) const
+    {
+      auto a = (*this)[type];
+      return a ? getAttr<T>(a) : T{};
+    }
+  };
+
+  template <>
+  Attributes getAttr<Attributes>(const rtattr *a);
+
+  template <>
+  rtnl_link_stats64 getAttr<rtnl_link_stats64>(const rtattr *a);
+
   struct NetLink
   {
     struct Request
@@ -47,32 +109,32 @@ namespace deter
 
     struct Response
     {
-      virtual ~Response();
       struct Message
       {
         nlmsghdr* header;
-        std::vector<rtattr*> attributes;
+
+        //indexed by attribute type, nullptr where the kernel did not send one
+        std::array<rtattr*, IFLA_MAX+1> attributes;
 
         template <typename T> 
         T getAttribute(int type) const
         {
-          for(const auto a : attributes)
-          {
-            if(a->rta_type == type) return getAttr<T>(a); 
-          }
-          return T{};
+          if(type < 0 || type > IFLA_MAX || attributes[type] == nullptr) 
+            return T{};
+          return getAttr<T>(attributes[type]); 
         }
 
         ifinfomsg* ifInfo() const;
       };
 
+      //grow the receive buffer to n bytes keeping messages pointing into it
+      void reserve(size_t n);
+
       std::vector<Message> messages;
-      char *data{nullptr};
-      int fd{0};
+      std::unique_ptr<char[]> data;
+      size_t size{0}, capacity{0};
     };
 
-    static int tx(Request r = Request{});
-    static Response rx(int);
     static Response getLink();
 
     static int testSock();
@@ -81,16 +143,152 @@ namespace deter
     static size_t linkSpeed(std::string ifx);
     static size_t capSpeed(std::string ifx);
     static size_t ifxIndex(std::string ifx);
+    static std::string ifxName(int index);
+
+    struct LinkMode
+    {
+      size_t speed{0};
+      std::string duplex{"full"};
+    };
+    static LinkMode linkMode(std::string ifx);
+
+    //linkMode of many interfaces at once, the ioctls are spread over up to 
+    //threads workers each with its own socket, 0 sizes it to the list. Only
+    //the monitor probes and links() without the monitor come through here
+    static std::vector<LinkMode> 
+    linkModes(const std::vector<std::string> & ifxs, size_t threads = 0);
+
+    //what is plugged into a port, decoded from the module eeprom
+    struct Transceiver
+    {
+      uint8_t id{0};           //SFF-8024 identifier, 0 when nothing is there
+      std::string module,      //sfp, qsfp+, qsfp28 ...
+                  media,       //compliance code, e.g. 100GBASE-SR4
+                  vendor,
+                  serial;
+      size_t capSpeed{0};
+    };
+    //reads the module eeprom, this is slow, prefer Link::module
+    static Transceiver transceiver(std::string ifx);
+
+    //decode a module eeprom of the given ETH_MODULE_SFF_* type
+    static Transceiver
+    decodeModule(uint32_t type, const uint8_t *ee, size_t len);
+
+    struct Link
+    {
+      int index{0};
+      std::string name, mac, kind;
+      unsigned flags{0};
+      uint8_t operstate{0};
+      uint32_t mtu{0};
+      int master{0};
+      size_t speed{0};
+      std::string duplex{"full"};
+
+      //transceiver inventory, kept by the monitor only
+      Transceiver module;
+    };
+
+    //hardware counters of every ethernet link, always from a fresh dump as
+    //the monitor only hears about state changes not traffic
+    struct LinkStats
+    {
+      std::string name;
+      rtnl_link_stats64 counters{};
+    };
+    static std::vector<LinkStats> stats();
+
+    //start the background link monitor that keeps the link table current,
+    //without it lookups fall back to SIOCGIFINDEX and links() to a dump.
+    //Module presence is swept every sweep seconds to catch insertions that 
+    //don't bring the link up
+    static void monitor(unsigned sweep = 60);
+    static std::vector<Link> links();
+
+    //changes whenever anything in the link table does, 0 when the monitor
+    //is not running and links() always goes to the kernel
+    static uint64_t generation();
 
     //setters
     static void enableIfx(std::string ifx);
     static void disableIfx(std::string ifx);
+
+    //set the admin state of many interfaces in one netlink round trip, 
+    //returns the interfaces that failed and why
+    static std::map<std::string, std::string> 
+    setIfxsUp(const std::vector<std::string> & ifxs, bool up);
     static void setIfxSpeed(std::string ifx, uint32_t speed);
     static void setIfxDuplex(std::string ifx, int duplex);
+
+    //bridge vlan programming
+    struct BridgeVlan
+    {
+      std::string ifx;
+      uint16_t vid;
+      bool pvid{false}; //untagged port vlan, i.e. an access vlan
+    };
+
+    //adds and removes bridge port vlans in a single netlink transaction, the
+    //bridge device itself is programmed with BRIDGE_FLAGS_SELF. Returns the
+    //interfaces the kernel refused so the caller can fall back to ifup
+    static std::vector<std::string> setBridgeVlans(
+        const std::vector<BridgeVlan> & add,
+        const std::vector<BridgeVlan> & del);
     
     private: 
     static int testSock_;
 
+    //long lived rtnetlink socket shared by all requests, see netlink.cxx
+    static int sock();
+    static void send(const void *buf, size_t len);
+    static void acks(uint32_t first, uint32_t last, 
+        std::function<void(uint32_t seq, int error)> f);
+    static std::string extAck(const nlmsghdr *nh);
+    static void setLink(std::string ifx, Request rq);
+    static std::map<std::string, std::string> 
+    setLinks(const std::vector<std::pair<std::string, Request>> & rqs);
+    static uint32_t tx(Request r = Request{});
+    static Response rx(uint32_t seq);
+    static Response::Message message(nlmsghdr *nh);
+
+    static int sock_;
+    static uint32_t seq_;
+    static std::mutex mtx_;
+
+    //size of the largest dump seen so far, the next one starts out this big
+    static size_t rxBytes_, rxMessages_;
+
+    //link monitor, see netlink.cxx
+    static int monitorSocket();
+    static void resync();
+    static void listen();
+    static Link link(const Response::Message & m);
+    static bool learn(const Response::Message & m);
+    static void forget(int index);
+    static void probe(const std::vector<std::pair<int, std::string>> & ls);
+
+    //replaced by the listener when it reopens, read without linkMtx_
+    static std::atomic<int> monSock_;
+    static std::mutex linkMtx_;
+    static std::unordered_map<std::string, int> indexes_;
+    static std::unordered_map<int, Link> links_;
+    static uint64_t generation_;
+
+    //transceiver inventory worker, see netlink.cxx
+    static void inventory(unsigned sweep);
+    static void 
+    checkModules(const std::vector<std::pair<int, std::string>> & ls);
+
+    //link mode probe workers, see netlink.cxx
+    struct Probers;
+    static Probers & probers();
+    static void prober();
+
+    static std::mutex invMtx_;
+    static std::condition_variable invCv_;
+    static std::vector<std::pair<int, std::string>> invQueue_;
+
   };
 
 
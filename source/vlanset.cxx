@@ -0,0 +1,167 @@
+#include "vlanset.hxx"
+#include <stdexcept>
+
+using std::string;
+using std::vector;
+using std::runtime_error;
+using std::out_of_range;
+using namespace deter;
+
+constexpr size_t VlanSet::Max;
+
+VlanSet::VlanSet(std::initializer_list<size_t> vids)
+{
+  for(size_t v : vids) add(v);
+}
+
+VlanSet::VlanSet(const vector<size_t> & vids)
+{
+  for(size_t v : vids) add(v);
+}
+
+/*
+ * Hand rolled rather than stringstream and stoul, a spine uplink carries
+ * thousands of vlans and this runs on every load
+ */
+VlanSet VlanSet::parse(const string & s)
+{
+  VlanSet set;
+  const char *p = s.c_str(), *end = p + s.size();
+
+  auto number = [&]() -> size_t
+  {
+    if(p == end || *p < '0' || *p > '9')
+      throw runtime_error{"bad vlan list `" + s + "`"};
+
+    size_t n{0};
+    for(; p != end && *p >= '0' && *p <= '9'; ++p)
+    {
+      n = n*10 + (*p - '0');
+      if(n >= Max) throw out_of_range{"vlan id out of range in `" + s + "`"};
+    }
+    return n;
+  };
+
+  for(;;)
+  {
+    while(p != end && (*p == ' ' || *p == '\t')) ++p;
+    if(p == end) break;
+
+    size_t lo = number();
+    size_t hi = lo;
+    if(p != end && *p == '-')
+    {
+      ++p;
+      hi = number();
+      if(hi < lo) throw runtime_error{"bad vlan range in `" + s + "`"};
+    }
+    set.add(lo, hi);
+
+    if(p != end && *p != ' ' && *p != '\t')
+      throw runtime_error{"bad vlan list `" + s + "`"};
+  }
+
+  return set;
+}
+
+string VlanSet::str() const
+{
+  string s;
+  auto emit = [&s](size_t lo, size_t hi)
+  {
+    if(!s.empty()) s += ' ';
+    s += std::to_string(lo);
+    if(hi == lo + 1) s += ' ' + std::to_string(hi);
+    else if(hi > lo) s += '-' + std::to_string(hi);
+  };
+
+  bool open{false};
+  size_t lo{0}, hi{0};
+  each([&](size_t v)
+  {
+    if(open && v == hi + 1) { hi = v; return; }
+    if(open) emit(lo, hi);
+    lo = hi = v;
+    open = true;
+  });
+  if(open) emit(lo, hi);
+
+  return s;
+}
+
+vector<size_t> VlanSet::ids() const
+{
+  vector<size_t> v;
+  v.reserve(size());
+  each([&v](size_t x){ v.push_back(x); });
+  return v;
+}
+
+void VlanSet::add(size_t vid)
+{
+  if(vid >= Max) throw out_of_range{"vlan id " + std::to_string(vid)};
+  words_[vid/64] |= uint64_t{1} << (vid%64);
+}
+
+void VlanSet::add(size_t lo, size_t hi)
+{
+  if(hi >= Max) throw out_of_range{"vlan id " + std::to_string(hi)};
+  for(size_t v = lo; v <= hi; ++v)
+  {
+    //whole words at a time once aligned
+    if(v%64 == 0 && hi - v >= 63)
+    {
+      words_[v/64] = ~uint64_t{0};
+      v += 63;
+      continue;
+    }
+    words_[v/64] |= uint64_t{1} << (v%64);
+  }
+}
+
+void VlanSet::remove(size_t vid)
+{
+  if(vid >= Max) return;
+  words_[vid/64] &= ~(uint64_t{1} << (vid%64));
+}
+
+bool VlanSet::test(size_t vid) const
+{
+  if(vid >= Max) return false;
+  return (words_[vid/64] >> (vid%64)) & 1;
+}
+
+bool VlanSet::empty() const
+{
+  for(uint64_t w : words_) if(w) return false;
+  return true;
+}
+
+size_t VlanSet::size() const
+{
+  size_t n{0};
+  for(uint64_t w : words_) n += __builtin_popcountll(w);
+  return n;
+}
+
+VlanSet & VlanSet::operator |= (const VlanSet & x)
+{
+  for(size_t i=0; i<words_.size(); ++i) words_[i] |= x.words_[i];
+  return *this;
+}
+
+VlanSet & VlanSet::operator &= (const VlanSet & x)
+{
+  for(size_t i=0; i<words_.size(); ++i) words_[i] &= x.words_[i];
+  return *this;
+}
+
+VlanSet & VlanSet::operator -= (const VlanSet & x)
+{
+  for(size_t i=0; i<words_.size(); ++i) words_[i] &= ~x.words_[i];
+  return *this;
+}
+
+VlanSet deter::operator | (VlanSet a, const VlanSet & b) { return a |= b; }
+VlanSet deter::operator & (VlanSet a, const VlanSet & b) { return a &= b; }
+VlanSet deter::operator - (VlanSet a, const VlanSet & b) { return a -= b; }
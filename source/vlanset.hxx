@@ -0,0 +1,68 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <initializer_list>
+
+namespace deter
+{
+  /*
+   * A set of 802.1Q vlan ids, one bit per id. Membership changes are a bit
+   * flip and the set operations go a 64 bit word at a time, so comparing or
+   * combining the vlans of ports costs the same whether they carry one vlan
+   * or all of them.
+   */
+  class VlanSet
+  {
+    public:
+      static constexpr size_t Max = 4096;
+
+      VlanSet() = default;
+      VlanSet(std::initializer_list<size_t> vids);
+      explicit VlanSet(const std::vector<size_t> & vids);
+
+      //the bridge-vids syntax, space separated ids and lo-hi ranges, throws
+      //on anything else
+      static VlanSet parse(const std::string & s);
+
+      //bridge-vids text, runs of three or more ids become ranges
+      std::string str() const;
+
+      //ids in increasing order
+      std::vector<size_t> ids() const;
+
+      void add(size_t vid);
+      void add(size_t lo, size_t hi);
+      void remove(size_t vid);
+      bool test(size_t vid) const;
+
+      bool empty() const;
+      size_t size() const;
+
+      VlanSet & operator |= (const VlanSet & x);
+      VlanSet & operator &= (const VlanSet & x);
+      VlanSet & operator -= (const VlanSet & x);
+
+      bool operator == (const VlanSet & x) const { return words_ == x.words_; }
+      bool operator != (const VlanSet & x) const { return words_ != x.words_; }
+
+      //calls f with every id in increasing order
+      template <class F> void each(F f) const
+      {
+        for(size_t w=0; w<words_.size(); ++w)
+        {
+          for(uint64_t bits = words_[w]; bits; bits &= bits - 1)
+            f(w*64 + __builtin_ctzll(bits));
+        }
+      }
+
+    private:
+      std::array<uint64_t, Max/64> words_{};
+  };
+
+  VlanSet operator | (VlanSet a, const VlanSet & b);
+  VlanSet operator & (VlanSet a, const VlanSet & b);
+  VlanSet operator - (VlanSet a, const VlanSet & b);
+}